@@ -5,6 +5,8 @@
 
 #include "include/cht/builder.h"
 #include "include/cht/cht.h"
+#include "include/cht/static_cht.h"
+#include "include/cht/tuner.h"
 
 using namespace std::chrono;
 
@@ -94,6 +96,25 @@ void Benchmark(bool single_pass) {
   out << std::endl;
 #endif
 
+  // The tuner's choice, for a budget of 1% of the keys, to compare with the
+  // sweep below.
+  {
+    auto start = high_resolution_clock::now();
+    const std::vector<KeyType> sample(queries.begin(),
+                                      queries.begin() + queries.size() / 100);
+    const auto tuned =
+        cht::Tune(keys, sample, keys.size() * sizeof(KeyType) / 100);
+    auto stop = high_resolution_clock::now();
+    std::cout << "Tune<"
+              << (std::is_same<KeyType, uint32_t>::value ? "uint32_t"
+                                                         : "uint64_t")
+              << ">: numBins=" << tuned.num_bins
+              << ", maxError=" << tuned.max_error << ", size=" << tuned.size
+              << " bytes, " << tuned.lookup_ns << " ns/lookup in "
+              << duration_cast<milliseconds>(stop - start).count() << " ms"
+              << std::endl;
+  }
+
   for (unsigned i = 1; i <= 10; ++i) {
     for (unsigned j = 1; j <= 10; ++j) {
       auto numBins = 1u << i, maxError = 1u << j;
@@ -110,6 +131,44 @@ void Benchmark(bool single_pass) {
       auto cht = chtb.Finalize();
       auto ccht = cchtb.Finalize();
 
+      // The adaptive fanout only exists for the offline build, and uses
+      // `numBins` as the maximum fanout.
+      cht::CompactHistTree<KeyType> acht;
+      if (!single_pass) {
+        cht::Builder<KeyType> achtb(min, max, numBins, maxError);
+        achtb.UseAdaptiveFanout(numBins);
+        for (const auto& key : keys) achtb.AddKey(key);
+        acht = achtb.Finalize();
+      }
+
+      // The path compression only exists for the offline build, too.
+      cht::CompactHistTree<KeyType> pcht;
+      if (!single_pass) {
+        cht::Builder<KeyType> pchtb(min, max, numBins, maxError);
+        pchtb.UsePathCompression();
+        for (const auto& key : keys) pchtb.AddKey(key);
+        pcht = pchtb.Finalize();
+        std::cout << "CHT-compressed<"
+                  << (std::is_same<KeyType, uint32_t>::value ? "uint32_t"
+                                                             : "uint64_t")
+                  << ">(numBins=" << numBins << ", maxError=" << maxError
+                  << "): " << cht.GetSize() << " -> " << pcht.GetSize()
+                  << " bytes" << std::endl;
+      }
+
+      // The batched lookups should return the same bounds as the scalar ones.
+      std::vector<cht::SearchBound> bounds(queries.size());
+      cht.GetSearchBounds(queries.data(), queries.size(), bounds.data());
+      for (unsigned index = 0; index != queries.size(); ++index) {
+        auto bound = cht.GetSearchBound(queries[index]);
+        if (bound.begin != bounds[index].begin ||
+            bound.end != bounds[index].end) {
+          std::cerr << "Batched lookup mismatch for query " << queries[index]
+                    << std::endl;
+          exit(EXIT_FAILURE);
+        }
+      }
+
       // Compare pure lookups
       auto measureTime = [&](std::string type) -> void {
         auto start = high_resolution_clock::now();
@@ -121,6 +180,24 @@ void Benchmark(bool single_pass) {
           for (auto query : queries) {
             ccht.GetSearchBound(query);
           }
+        } else if (type == "CHT-static") {
+          cht::WithStaticFanout(cht, [&](const auto& scht) {
+            for (auto query : queries) {
+              scht.GetSearchBound(query);
+            }
+          });
+        } else if (type == "CHT-batch") {
+          cht.GetSearchBounds(queries.data(), queries.size(), bounds.data());
+        } else if (type == "CCHT-batch") {
+          ccht.GetSearchBounds(queries.data(), queries.size(), bounds.data());
+        } else if (type == "CHT-adaptive") {
+          for (auto query : queries) {
+            acht.GetSearchBound(query);
+          }
+        } else if (type == "CHT-compressed") {
+          for (auto query : queries) {
+            pcht.GetSearchBound(query);
+          }
         }
 
         auto stop = high_resolution_clock::now();
@@ -136,6 +213,11 @@ void Benchmark(bool single_pass) {
       for (unsigned index = 0; index != 5; ++index) {
         measureTime("CHT");
         measureTime("CCHT");
+        measureTime("CHT-static");
+        measureTime("CHT-batch");
+        measureTime("CCHT-batch");
+        if (!single_pass) measureTime("CHT-adaptive");
+        if (!single_pass) measureTime("CHT-compressed");
       }
     }
   }
@@ -1,10 +1,16 @@
+#include <pthread.h>
+#include <sched.h>
+
+#include <atomic>
 #include <chrono>
 #include <fstream>
 #include <iostream>
 #include <map>
+#include <thread>
 
 #include "include/cht/builder.h"
 #include "include/cht/cht.h"
+#include "include/cht/sosd.h"
 
 using namespace std;
 
@@ -13,20 +19,13 @@ namespace util {
 // Loads values from binary file into vector.
 template <typename T>
 static vector<T> load_data(const string& filename, bool print = true) {
-  vector<T> data;
-  ifstream in(filename, ios::binary);
-  if (!in.is_open()) {
-    cerr << "unable to open " << filename << endl;
+  try {
+    const cht::SosdFile<T> file(filename);
+    return vector<T>(file.data(), file.data() + file.size());
+  } catch (const runtime_error& e) {
+    cerr << e.what() << endl;
     exit(EXIT_FAILURE);
   }
-  // Read size.
-  uint64_t size;
-  in.read(reinterpret_cast<char*>(&size), sizeof(uint64_t));
-  data.resize(size);
-  // Read values.
-  in.read(reinterpret_cast<char*>(data.data()), size * sizeof(T));
-
-  return data;
 }
 
 // Generates deterministic values for keys.
@@ -56,7 +55,10 @@ class NonOwningMultiMap {
 
   NonOwningMultiMap(const vector<element_type>& elements,
                     const uint32_t num_bins, const uint32_t max_error,
-                    const bool single_pass, const bool ccht)
+                    const bool single_pass, const bool ccht,
+                    const size_t num_threads, const size_t max_adaptive_bins,
+                    const bool path_compression, const size_t root_num_bins,
+                    const bool huge_pages, const unsigned bounds)
       : data_(elements) {
     assert(elements.size() > 0);
 
@@ -64,21 +66,22 @@ class NonOwningMultiMap {
     const auto min_key = data_.front().first;
     const auto max_key = data_.back().first;
     cht::Builder<KeyType> chtb(min_key, max_key, num_bins, max_error,
-                               single_pass, ccht);
+                               single_pass, ccht, num_threads);
+    if (max_adaptive_bins) chtb.UseAdaptiveFanout(max_adaptive_bins);
+    if (path_compression) chtb.UsePathCompression();
+    if (root_num_bins) chtb.UseRootFanout(root_num_bins);
+    if (!huge_pages) chtb.DisableHugePages();
+    if (bounds == 1) chtb.UseTightBounds();
+    if (bounds == 2) chtb.UseInterpolation();
 
-    // Build the index.
-    for (const auto& iter : data_) {
-      chtb.AddKey(iter.first);
-    }
-    cht_ = chtb.Finalize();
+    // Build the index, reading the keys in place.
+    cht_ = chtb.Build(data_.data(), data_.size(), &element_type::first);
+    build_peak_bytes_ = chtb.GetPeakBytes();
   }
 
   typename vector<element_type>::const_iterator lower_bound(KeyType key) const {
-    cht::SearchBound bound = cht_.GetSearchBound(key);
-    return ::lower_bound(data_.begin() + bound.begin, data_.begin() + bound.end,
-                         key, [](const element_type& lhs, const KeyType& rhs) {
-                           return lhs.first < rhs;
-                         });
+    return data_.begin() +
+           cht_.LowerBound(data_.data(), &element_type::first, key);
   }
 
   uint64_t sum_up(KeyType key) const {
@@ -93,9 +96,16 @@ class NonOwningMultiMap {
 
   size_t GetSizeInByte() const { return cht_.GetSize(); }
 
+  size_t GetAllocatedSizeInByte() const { return cht_.GetAllocatedSize(); }
+
+  cht::TreeStats GetStats() const { return cht_.Stats(); }
+
+  size_t GetBuildPeakBytes() const { return build_peak_bytes_; }
+
  private:
   const vector<element_type>& data_;
   cht::CompactHistTree<KeyType> cht_;
+  size_t build_peak_bytes_;
 };
 
 template <class KeyType>
@@ -104,10 +114,79 @@ struct Lookup {
   uint64_t value;
 };
 
+// Pins the calling thread to `core`, modulo the available cores.
+static void PinToCore(size_t core) {
+  const size_t num_cores = max<size_t>(thread::hardware_concurrency(), 1);
+  cpu_set_t cpus;
+  CPU_ZERO(&cpus);
+  CPU_SET(core % num_cores, &cpus);
+  pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+}
+
+// Runs all lookups on each of `num_lookup_threads` threads against the shared
+// map, and prints the aggregate throughput and the mean and maximum time of a
+// lookup on a thread. The threads start at different offsets into the
+// lookups, so that they do not touch the same entries at the same time.
+template <class KeyType>
+static void RunScaling(const NonOwningMultiMap<KeyType, uint64_t>& map,
+                       const vector<Lookup<KeyType>>& lookups,
+                       const string& data_file, const uint32_t num_bins,
+                       const uint32_t max_error,
+                       const size_t num_lookup_threads) {
+  vector<uint64_t> thread_ns(num_lookup_threads);
+  atomic<size_t> num_ready(0);
+  atomic<bool> start(false);
+  atomic<bool> wrong(false);
+  vector<thread> threads;
+  for (size_t t = 0; t < num_lookup_threads; ++t) {
+    threads.emplace_back([&, t]() {
+      PinToCore(t);
+      const size_t offset = t * lookups.size() / num_lookup_threads;
+      num_ready++;
+      while (!start.load(memory_order_acquire)) this_thread::yield();
+      auto lookup_begin = chrono::high_resolution_clock::now();
+      for (size_t i = 0; i < lookups.size(); ++i) {
+        const auto& lookup_iter = lookups[(offset + i) % lookups.size()];
+        if (map.sum_up(lookup_iter.key) != lookup_iter.value) wrong = true;
+      }
+      auto lookup_end = chrono::high_resolution_clock::now();
+      thread_ns[t] =
+          chrono::duration_cast<chrono::nanoseconds>(lookup_end - lookup_begin)
+              .count();
+    });
+  }
+  while (num_ready != num_lookup_threads) this_thread::yield();
+  auto run_begin = chrono::high_resolution_clock::now();
+  start.store(true, memory_order_release);
+  for (auto& t : threads) t.join();
+  auto run_end = chrono::high_resolution_clock::now();
+  if (wrong) {
+    cerr << "wrong result!" << endl;
+    throw "error";
+  }
+
+  const uint64_t run_ns =
+      chrono::duration_cast<chrono::nanoseconds>(run_end - run_begin).count();
+  uint64_t sum_ns = 0, max_ns = 0;
+  for (const auto ns : thread_ns) {
+    sum_ns += ns;
+    max_ns = max(max_ns, ns);
+  }
+  const double num_lookups = static_cast<double>(lookups.size());
+  cout << "scaling," << data_file << "," << num_bins << "," << max_error << ","
+       << num_lookup_threads << ","
+       << num_lookups * num_lookup_threads / run_ns * 1000 << ","
+       << sum_ns / num_lookup_threads / num_lookups << ","
+       << max_ns / num_lookups << endl;
+}
+
 template <class KeyType>
 void Run(const string& data_file, const string lookup_file,
          const uint32_t num_bins, const uint32_t max_error,
-         const bool single_pass, const bool ccht) {
+         const bool single_pass, const bool ccht, const size_t num_threads,
+         const size_t max_adaptive_bins, const bool path_compression,
+         const size_t root_num_bins, const bool huge_pages,
+         const size_t max_lookup_threads, const unsigned bounds) {
   // Load data
   std::cerr << "Load data.." << std::endl;
   vector<KeyType> keys = util::load_data<KeyType>(data_file);
@@ -119,11 +198,18 @@ void Run(const string& data_file, const string lookup_file,
   std::cerr << "Build index.." << std::endl;
   auto build_begin = chrono::high_resolution_clock::now();
   NonOwningMultiMap<KeyType, uint64_t> map(elements, num_bins, max_error,
-                                           single_pass, ccht);
+                                           single_pass, ccht, num_threads,
+                                           max_adaptive_bins, path_compression,
+                                           root_num_bins, huge_pages,
+                                           bounds);
   auto build_end = chrono::high_resolution_clock::now();
   uint64_t build_ns =
       chrono::duration_cast<chrono::nanoseconds>(build_end - build_begin)
           .count();
+  const auto stats = map.GetStats();
+  std::cerr << "Depth: max " << stats.max_depth << ", avg " << stats.avg_depth
+            << ", oversized leaves: " << stats.num_oversized_leaves
+            << std::endl;
 
   // Run queries
   std::cerr << "Run queries.." << std::endl;
@@ -149,16 +235,33 @@ void Run(const string& data_file, const string lookup_file,
        << "," << ccht << ","
        << static_cast<double>(map.GetSizeInByte()) / 1000 / 1000 << ","
        << static_cast<double>(build_ns) / 1000 / 1000 / 1000 << ","
-       << lookup_ns[1] << endl;
+       << lookup_ns[1] << ","
+       << static_cast<double>(map.GetBuildPeakBytes()) / 1000 / 1000 << ","
+       << max_adaptive_bins << "," << path_compression << "," << root_num_bins
+       << "," << huge_pages << ","
+       << static_cast<double>(map.GetAllocatedSizeInByte()) / 1000 / 1000
+       << "," << bounds << endl;
+
+  // Scale the lookups over 1, 2, 4, .. and `max_lookup_threads` threads.
+  if (max_lookup_threads) {
+    std::cerr << "Run queries on up to " << max_lookup_threads
+              << " threads.." << std::endl;
+    for (size_t t = 1; t < max_lookup_threads; t *= 2)
+      RunScaling(map, lookups, data_file, num_bins, max_error, t);
+    RunScaling(map, lookups, data_file, num_bins, max_error,
+               max_lookup_threads);
+  }
 }
 
 }  // namespace
 
 int main(int argc, char** argv) {
-  if (argc != 7) {
+  if (argc < 7 || argc > 14) {
     cerr << "usage: " << argv[0]
          << " <data_file> <lookup_file> <num_bins> <max_error> <single_pass> "
-            "<ccht>"
+            "<ccht> [<num_build_threads> [<max_adaptive_bins> "
+            "[<path_compression> [<root_num_bins> [<huge_pages> "
+            "[<max_lookup_threads> [<bounds>]]]]]]]"
          << endl;
     throw;
   }
@@ -168,13 +271,32 @@ int main(int argc, char** argv) {
   const uint32_t max_error = atoi(argv[4]);
   const bool single_pass = atoi(argv[5]);
   const bool ccht = atoi(argv[6]);
+  const size_t num_threads = (argc >= 8) ? atoi(argv[7]) : 1;
+  // If set, the fanout of each node is chosen up to this many bins.
+  const size_t max_adaptive_bins = (argc >= 9) ? atol(argv[8]) : 0;
+  // If set, the chains of single-child nodes are collapsed.
+  const bool path_compression = (argc >= 10) ? atoi(argv[9]) : 0;
+  // If set, the root has this many bins instead of `num_bins`.
+  const size_t root_num_bins = (argc >= 11) ? atol(argv[10]) : 0;
+  // Whether a large table is backed by transparent huge pages.
+  const bool huge_pages = (argc >= 12) ? atoi(argv[11]) : 1;
+  // If set, the lookups are also run on 1 up to this many threads, each
+  // pinned to a core, and a line per thread count is printed.
+  const size_t max_lookup_threads = (argc >= 13) ? atol(argv[12]) : 0;
+  // The search bounds span `max_error` (0), end at the next bin (1), or are
+  // interpolated within the bin (2).
+  const unsigned bounds = (argc == 14) ? atoi(argv[13]) : 0;
 
   if (data_file.find("32") != string::npos) {
     Run<uint32_t>(data_file, lookup_file, num_bins, max_error, single_pass,
-                  ccht);
+                  ccht, num_threads, max_adaptive_bins, path_compression,
+                  root_num_bins, huge_pages, max_lookup_threads,
+                  bounds);
   } else {
     Run<uint64_t>(data_file, lookup_file, num_bins, max_error, single_pass,
-                  ccht);
+                  ccht, num_threads, max_adaptive_bins, path_compression,
+                  root_num_bins, huge_pages, max_lookup_threads,
+                  bounds);
   }
 
   return 0;
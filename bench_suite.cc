@@ -0,0 +1,331 @@
+// Benchmarks the lookups over several key distributions with Google
+// Benchmark. Besides the throughput, each benchmark reports the p50, p99 and
+// p99.9 latency of a single lookup, and the LLC misses, dTLB misses, branch
+// misses and instructions per lookup, as far as `perf_event_open` allows.
+//
+// usage: bench_suite [<benchmark flags>] [<sosd_file>...]
+//
+// The SOSD files hold a 64-bit count followed by the keys, which are 32-bit
+// if the file name contains "uint32".
+#include <benchmark/benchmark.h>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "include/cht/builder.h"
+#include "include/cht/cht.h"
+#include "include/cht/sosd.h"
+
+namespace {
+
+using KeyType = uint64_t;
+
+constexpr size_t kNumKeys = 10'000'000;
+constexpr size_t kNumQueries = 1 << 20;
+// The number of lookups timed one by one for the percentiles.
+constexpr size_t kNumLatencySamples = 1 << 18;
+constexpr size_t kBatchSize = 64;
+
+struct Dataset {
+  std::string name;
+  std::vector<KeyType> keys;
+  // Keys of `keys`, in random order.
+  std::vector<KeyType> queries;
+};
+
+std::vector<KeyType> Generate(const std::string& distribution, size_t size) {
+  std::mt19937_64 g(42);
+  std::vector<KeyType> keys;
+  keys.reserve(size);
+  if (distribution == "uniform") {
+    std::uniform_int_distribution<KeyType> d;
+    while (keys.size() < size) keys.push_back(d(g));
+  } else if (distribution == "normal") {
+    std::normal_distribution<double> d(0, 1);
+    while (keys.size() < size) {
+      const double x = std::ldexp(d(g), 58) + std::ldexp(1.0, 63);
+      if (x >= 0 && x < std::ldexp(1.0, 64)) keys.push_back(KeyType(x));
+    }
+  } else if (distribution == "lognormal") {
+    std::lognormal_distribution<double> d(0, 2);
+    while (keys.size() < size) {
+      const double x = d(g) * 1e12;
+      if (x < std::ldexp(1.0, 64)) keys.push_back(KeyType(x));
+    }
+  } else if (distribution == "clustered") {
+    // Dense ranges of 2^20 keys at 100 random places.
+    std::vector<KeyType> centers(100);
+    for (auto& center : centers) center = g() >> 1;
+    std::uniform_int_distribution<KeyType> offset(0, KeyType(1) << 20);
+    while (keys.size() < size)
+      keys.push_back(centers[g() % centers.size()] + offset(g));
+  }
+  std::sort(keys.begin(), keys.end());
+  keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+  return keys;
+}
+
+template <class T>
+std::vector<KeyType> LoadSOSD(const std::string& path) {
+  try {
+    const cht::SosdFile<T> file(path);
+    return std::vector<KeyType>(file.data(), file.data() + file.size());
+  } catch (const std::runtime_error& e) {
+    std::cerr << e.what() << std::endl;
+    exit(EXIT_FAILURE);
+  }
+}
+
+std::unique_ptr<Dataset> MakeDataset(std::string name,
+                                     std::vector<KeyType> keys) {
+  auto dataset = std::make_unique<Dataset>();
+  dataset->name = std::move(name);
+  dataset->keys = std::move(keys);
+  std::mt19937_64 g(815);
+  std::uniform_int_distribution<size_t> d(0, dataset->keys.size() - 1);
+  dataset->queries.reserve(kNumQueries);
+  for (size_t index = 0; index != kNumQueries; ++index)
+    dataset->queries.push_back(dataset->keys[d(g)]);
+  return dataset;
+}
+
+// Reads a hardware counter of this thread through `perf_event_open`. The
+// counter is unavailable, e.g. without the permissions, if `fd_` is -1.
+class PerfCounter {
+ public:
+  PerfCounter(uint32_t type, uint64_t config) {
+    perf_event_attr attr = {};
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    fd_ = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+  }
+
+  ~PerfCounter() {
+    if (fd_ != -1) close(fd_);
+  }
+
+  PerfCounter(const PerfCounter&) = delete;
+  PerfCounter& operator=(const PerfCounter&) = delete;
+
+  bool IsAvailable() const { return fd_ != -1; }
+
+  void Start() {
+    if (fd_ == -1) return;
+    ioctl(fd_, PERF_EVENT_IOC_RESET, 0);
+    ioctl(fd_, PERF_EVENT_IOC_ENABLE, 0);
+  }
+
+  uint64_t Stop() {
+    if (fd_ == -1) return 0;
+    ioctl(fd_, PERF_EVENT_IOC_DISABLE, 0);
+    uint64_t value = 0;
+    if (read(fd_, &value, sizeof(value)) != sizeof(value)) return 0;
+    return value;
+  }
+
+ private:
+  int fd_;
+};
+
+constexpr uint64_t CacheEvent(uint64_t cache) {
+  return cache | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+         (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+}
+
+// The counters reported per lookup.
+struct PerfCounters {
+  PerfCounter instructions{PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS};
+  PerfCounter llc_misses{PERF_TYPE_HW_CACHE,
+                         CacheEvent(PERF_COUNT_HW_CACHE_LL)};
+  PerfCounter dtlb_misses{PERF_TYPE_HW_CACHE,
+                          CacheEvent(PERF_COUNT_HW_CACHE_DTLB)};
+  PerfCounter branch_misses{PERF_TYPE_HARDWARE,
+                            PERF_COUNT_HW_BRANCH_MISSES};
+
+  template <class Func>
+  void ForEach(Func func) {
+    func("instructions", instructions);
+    func("LLC-misses", llc_misses);
+    func("dTLB-misses", dtlb_misses);
+    func("branch-misses", branch_misses);
+  }
+};
+
+// Reads a cycle counter, which is converted to nanoseconds with
+// `NanosPerTick`.
+uint64_t ReadTicks() {
+#if defined(__x86_64__) || defined(__i386__)
+  unsigned aux;
+  return __rdtscp(&aux);
+#else
+  return std::chrono::steady_clock::now().time_since_epoch().count();
+#endif
+}
+
+double NanosPerTick() {
+  static const double nanosPerTick = [] {
+    const auto start = std::chrono::steady_clock::now();
+    const auto startTicks = ReadTicks();
+    while (std::chrono::steady_clock::now() - start <
+           std::chrono::milliseconds(50)) {
+    }
+    const auto ticks = ReadTicks() - startTicks;
+    const auto nanos = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                           std::chrono::steady_clock::now() - start)
+                           .count();
+    return static_cast<double>(nanos) / ticks;
+  }();
+  return nanosPerTick;
+}
+
+// The trees are built once per dataset and parameters, since Google Benchmark
+// may run a benchmark several times.
+const cht::CompactHistTree<KeyType>& GetTree(const Dataset& dataset,
+                                             size_t num_bins,
+                                             size_t max_error) {
+  static std::map<std::tuple<const Dataset*, size_t, size_t>,
+                  cht::CompactHistTree<KeyType>>
+      trees;
+  const auto key = std::make_tuple(&dataset, num_bins, max_error);
+  auto it = trees.find(key);
+  if (it == trees.end()) {
+    cht::Builder<KeyType> chtb(dataset.keys.front(), dataset.keys.back(),
+                               num_bins, max_error);
+    for (const auto& k : dataset.keys) chtb.AddKey(k);
+    it = trees.emplace(key, chtb.Finalize()).first;
+  }
+  return it->second;
+}
+
+enum class Kind { SearchBound, LowerBound, BatchLowerBound };
+
+// Runs `kind` lookups. One iteration is a single lookup, or a batch of
+// `kBatchSize` for `BatchLowerBound`.
+void BM_Lookup(benchmark::State& state, const Dataset* dataset, Kind kind) {
+  const auto& cht = GetTree(*dataset, state.range(0), state.range(1));
+  const auto& keys = dataset->keys;
+  const auto& queries = dataset->queries;
+  const size_t lookupsPerIteration =
+      kind == Kind::BatchLowerBound ? kBatchSize : 1;
+  size_t out[kBatchSize];
+
+  const auto lookup = [&](size_t index) {
+    switch (kind) {
+      case Kind::SearchBound:
+        benchmark::DoNotOptimize(cht.GetSearchBound(queries[index]));
+        break;
+      case Kind::LowerBound:
+        benchmark::DoNotOptimize(cht.LowerBound(keys.data(), queries[index]));
+        break;
+      case Kind::BatchLowerBound:
+        cht.LowerBounds(keys.data(), &queries[index], kBatchSize, out);
+        benchmark::DoNotOptimize(out);
+        break;
+    }
+  };
+
+  PerfCounters perf;
+  perf.ForEach([](const char*, PerfCounter& counter) { counter.Start(); });
+  size_t index = 0;
+  for (auto _ : state) {
+    lookup(index);
+    index += lookupsPerIteration;
+    if (index + lookupsPerIteration > queries.size()) index = 0;
+  }
+  const double numLookups =
+      static_cast<double>(state.iterations()) * lookupsPerIteration;
+  perf.ForEach([&](const char* name, PerfCounter& counter) {
+    const auto value = counter.Stop();
+    if (counter.IsAvailable()) state.counters[name] = value / numLookups;
+  });
+
+  // Time the lookups one by one, outside of the measured loop. Since the
+  // timer serializes, these are latencies, which exceed the mean above: the
+  // measured loop overlaps the cache misses of consecutive lookups.
+  std::vector<uint64_t> ticks;
+  ticks.reserve(kNumLatencySamples / lookupsPerIteration);
+  for (size_t index = 0; index + lookupsPerIteration <= kNumLatencySamples;
+       index += lookupsPerIteration) {
+    const auto start = ReadTicks();
+    lookup(index % (queries.size() - lookupsPerIteration));
+    ticks.push_back(ReadTicks() - start);
+  }
+  std::sort(ticks.begin(), ticks.end());
+  const auto percentile = [&](double p) {
+    const size_t rank =
+        std::min(ticks.size() - 1, static_cast<size_t>(p * ticks.size()));
+    return ticks[rank] * NanosPerTick() / lookupsPerIteration;
+  };
+  state.counters["p50_ns"] = percentile(0.5);
+  state.counters["p99_ns"] = percentile(0.99);
+  state.counters["p999_ns"] = percentile(0.999);
+  state.counters["size_MB"] = cht.GetSize() / 1e6;
+  state.SetItemsProcessed(state.iterations() * lookupsPerIteration);
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  benchmark::Initialize(&argc, argv);
+
+  std::vector<std::unique_ptr<Dataset>> datasets;
+  for (const char* distribution :
+       {"uniform", "normal", "lognormal", "clustered"}) {
+    datasets.push_back(
+        MakeDataset(distribution, Generate(distribution, kNumKeys)));
+  }
+  // The remaining arguments are SOSD files.
+  for (int index = 1; index < argc; ++index) {
+    const std::string path = argv[index];
+    if (path.rfind("--", 0) == 0) {
+      std::cerr << "unknown flag " << path << std::endl;
+      return EXIT_FAILURE;
+    }
+    auto keys = path.find("uint32") != std::string::npos
+                    ? LoadSOSD<uint32_t>(path)
+                    : LoadSOSD<uint64_t>(path);
+    datasets.push_back(MakeDataset(path.substr(path.rfind('/') + 1),
+                                   std::move(keys)));
+  }
+
+  const std::pair<const char*, Kind> kinds[] = {
+      {"SearchBound", Kind::SearchBound},
+      {"LowerBound", Kind::LowerBound},
+      {"BatchLowerBound", Kind::BatchLowerBound}};
+  for (const auto& dataset : datasets) {
+    for (const auto& [name, kind] : kinds) {
+      benchmark::RegisterBenchmark(
+          (std::string(name) + "/" + dataset->name).c_str(), BM_Lookup,
+          dataset.get(), kind)
+          ->ArgNames({"num_bins", "max_error"})
+          ->Args({64, 32})
+          ->Args({256, 16})
+          ->Args({1024, 64});
+    }
+  }
+
+  benchmark::RunSpecifiedBenchmarks();
+  benchmark::Shutdown();
+  return 0;
+}
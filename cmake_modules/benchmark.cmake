@@ -0,0 +1,39 @@
+# Use an installed Google Benchmark, otherwise build it.
+find_package(benchmark QUIET)
+
+if (NOT benchmark_FOUND)
+    include(ExternalProject)
+    find_package(Git REQUIRED)
+    find_package(Threads REQUIRED)
+
+    # Get benchmark
+    ExternalProject_Add(
+            benchmark_src
+            PREFIX "extern/benchmark"
+            GIT_REPOSITORY "https://github.com/google/benchmark.git"
+            GIT_TAG "v1.8.3"
+            TIMEOUT 10
+            CMAKE_ARGS
+            -DCMAKE_INSTALL_PREFIX=${CMAKE_BINARY_DIR}/extern/benchmark
+            -DCMAKE_INSTALL_LIBDIR=lib
+            -DCMAKE_BUILD_TYPE=Release
+            -DCMAKE_C_COMPILER=${CMAKE_C_COMPILER}
+            -DCMAKE_CXX_COMPILER=${CMAKE_CXX_COMPILER}
+            -DCMAKE_CXX_FLAGS=${CMAKE_CXX_FLAGS}
+            -DBENCHMARK_ENABLE_TESTING=OFF
+            -DBENCHMARK_ENABLE_GTEST_TESTS=OFF
+            UPDATE_COMMAND ""
+    )
+
+    # Prepare benchmark
+    ExternalProject_Get_Property(benchmark_src install_dir)
+    file(MAKE_DIRECTORY ${install_dir}/include)
+    add_library(benchmark::benchmark UNKNOWN IMPORTED)
+    set_target_properties(benchmark::benchmark PROPERTIES
+            IMPORTED_LOCATION ${install_dir}/lib/libbenchmark.a
+            INTERFACE_INCLUDE_DIRECTORIES ${install_dir}/include
+            INTERFACE_LINK_LIBRARIES Threads::Threads)
+
+    # Dependencies
+    add_dependencies(benchmark::benchmark benchmark_src)
+endif ()
@@ -7,12 +7,52 @@ MAX_ERROR="1 2 4 8 16 32 64 128 256 512 1024"
 
 DATA_SETS="../SOSD/data/books_200M_uint64"
 
+# Sweeps all parameters. `cht::Tune` in include/cht/tuner.h instead picks them
+# from estimates and times only a few candidates.
+
 for DATA_SET in $DATA_SETS; do
   for BIN in $NUM_BINS; do
     for ERROR in $MAX_ERROR; do
       ./build/bench_end_to_end $DATA_SET ${DATA_SET}_equality_lookups_10M $BIN $ERROR 0 0
       ./build/bench_end_to_end $DATA_SET ${DATA_SET}_equality_lookups_10M $BIN $ERROR 0 1
       ./build/bench_end_to_end $DATA_SET ${DATA_SET}_equality_lookups_10M $BIN $ERROR 1 0
+      ./build/bench_end_to_end $DATA_SET ${DATA_SET}_equality_lookups_10M $BIN $ERROR 1 1
+    done;
+  done;
+  # Adaptive fanout, with up to 2^20 bins per node.
+  for ERROR in $MAX_ERROR; do
+    ./build/bench_end_to_end $DATA_SET ${DATA_SET}_equality_lookups_10M 64 $ERROR 0 0 1 1048576
+  done;
+  # Path compression of the single-child chains.
+  for BIN in $NUM_BINS; do
+    for ERROR in $MAX_ERROR; do
+      ./build/bench_end_to_end $DATA_SET ${DATA_SET}_equality_lookups_10M $BIN $ERROR 0 0 1 0 1
+    done;
+  done;
+  # The table with regular pages instead of huge pages.
+  for BIN in $NUM_BINS; do
+    for ERROR in $MAX_ERROR; do
+      ./build/bench_end_to_end $DATA_SET ${DATA_SET}_equality_lookups_10M $BIN $ERROR 0 0 1 0 0 0 0
+    done;
+  done;
+  # The search bounds ending at the next bin.
+  for BIN in $NUM_BINS; do
+    for ERROR in $MAX_ERROR; do
+      ./build/bench_end_to_end $DATA_SET ${DATA_SET}_equality_lookups_10M $BIN $ERROR 0 0 1 0 0 0 1 0 1
+    done;
+  done;
+  # The positions interpolated within the bins.
+  for BIN in $NUM_BINS; do
+    for ERROR in $MAX_ERROR; do
+      ./build/bench_end_to_end $DATA_SET ${DATA_SET}_equality_lookups_10M $BIN $ERROR 0 0 1 0 0 0 1 0 2
+    done;
+  done;
+  # The lookups on 1 up to 64 threads against the same tree.
+  ./build/bench_end_to_end $DATA_SET ${DATA_SET}_equality_lookups_10M 64 32 0 0 1 0 0 0 1 64
+  # A root of 2^16 to 2^20 bins on top of the uniform tree.
+  for ROOT in 65536 262144 1048576; do
+    for BIN in $NUM_BINS; do
+      ./build/bench_end_to_end $DATA_SET ${DATA_SET}_equality_lookups_10M $BIN 32 0 0 1 0 0 $ROOT
     done;
   done;
 done;
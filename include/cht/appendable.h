@@ -0,0 +1,208 @@
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <cstddef>
+#include <vector>
+
+#include "common.h"
+#include "search.h"
+
+namespace cht {
+
+// An index over keys which arrive in increasing order, e.g. timestamps, with
+// no upper bound known in advance. The tree starts with a root covering
+// `num_bins` keys, and when a key falls beyond the covered range, a new root
+// is added on top, whose first bin points to the old root. Since the keys only
+// grow, every subtree left of the last key is final: an append only touches
+// the path of the last key, and splits its rightmost leaf once it holds more
+// than `max_error` keys. Lookups and appends may be interleaved, but not run
+// concurrently.
+template <class KeyType>
+class AppendableCompactHistTree {
+ public:
+  AppendableCompactHistTree(KeyType min_key, size_t num_bins, size_t max_error)
+      : min_key_(min_key),
+        num_bins_(num_bins),
+        log_num_bins_(__builtin_ctzll(num_bins)),
+        max_error_(max_error) {
+    assert(num_bins_ >= 2 && (num_bins_ & (num_bins_ - 1)) == 0);
+  }
+
+  // Appends `key`, which must not be less than the previous one.
+  void Append(KeyType key) {
+    assert(key >= min_key_);
+    assert(keys_.empty() || key >= keys_.back());
+
+    const size_t pos = keys_.size();
+    if (keys_.empty()) {
+      root_ = AddNode(pos);
+      path_.push_back({root_, 0});
+    }
+    while (!Covers(key)) GrowRoot(pos);
+
+    // Find the first level at which `key` leaves the path of the last key.
+    // All bins left of `key` then hold their final partial sums.
+    size_t level = 0;
+    while (level != path_.size() && path_[level].bin == BinOf(key, level))
+      ++level;
+    keys_.push_back(key);
+    if (level != path_.size()) {
+      for (size_t deeper = path_.size() - 1; deeper != level; --deeper)
+        SetLeaves(path_[deeper].node, path_[deeper].bin + 1, num_bins_, pos);
+      const auto bin = BinOf(key, level);
+      SetLeaves(path_[level].node, path_[level].bin + 1, bin + 1, pos);
+      path_.resize(level + 1);
+      path_[level].bin = bin;
+      return;
+    }
+
+    // Same leaf as the last key: split it once it has too many keys.
+    const auto& last = path_.back();
+    const size_t begin = table_[Index(last.node, last.bin)] & Mask;
+    if (keys_.size() - begin > max_error_) Split(begin);
+  }
+
+  // Returns a search bound [`begin`, `end`) around the estimated position.
+  SearchBound GetSearchBound(KeyType key) const {
+    const size_t begin = Lookup(key);
+    // `end` is exclusive.
+    const size_t end = (begin + max_error_ + 1 > keys_.size())
+                           ? keys_.size()
+                           : (begin + max_error_ + 1);
+    return SearchBound{begin, end};
+  }
+
+  // Returns the position of the first key which is not less than `key`.
+  size_t LowerBound(KeyType key) const {
+    if (keys_.empty()) return 0;
+    const auto bound = GetSearchBound(key);
+    return search::LowerBound(search::DenseKeys<KeyType>{keys_.data()},
+                              bound.begin, bound.end, key);
+  }
+
+  // Returns the appended keys.
+  const std::vector<KeyType>& keys() const { return keys_; }
+
+  // Returns the number of levels of the tree.
+  size_t GetDepth() const { return num_levels_; }
+
+  // Returns the size in bytes, excluding the keys.
+  size_t GetSize() const {
+    return sizeof(*this) + table_.capacity() * sizeof(unsigned) +
+           path_.capacity() * sizeof(PathStep);
+  }
+
+ private:
+  static constexpr unsigned Leaf = EntryTraits<unsigned>::Leaf;
+  static constexpr unsigned Mask = EntryTraits<unsigned>::Mask;
+
+  // The node and the bin of the last key at one level.
+  struct PathStep {
+    size_t node;
+    size_t bin;
+  };
+
+  size_t Index(size_t node, size_t bin) const {
+    return (node << log_num_bins_) + bin;
+  }
+
+  // The root covers `num_bins_ << shift_` keys. Since `shift_` grows by
+  // `log_num_bins_`, the bins of the last level are single keys.
+  unsigned Width(size_t level) const {
+    return shift_ - level * log_num_bins_;
+  }
+
+  size_t BinOf(KeyType key, size_t level) const {
+    return ((key - min_key_) >> Width(level)) & (num_bins_ - 1);
+  }
+
+  bool Covers(KeyType key) const {
+    const unsigned width = shift_ + log_num_bins_;
+    return width >= 8 * sizeof(KeyType) || ((key - min_key_) >> width) == 0;
+  }
+
+  // Adds a node whose bins are leaves at `pos`, and returns its index.
+  size_t AddNode(size_t pos) {
+    const size_t node = table_.size() >> log_num_bins_;
+    assert(node <= Mask && pos <= Mask);
+    table_.resize(table_.size() + num_bins_, Leaf | static_cast<unsigned>(pos));
+    return node;
+  }
+
+  void SetLeaves(size_t node, size_t begin, size_t end, size_t pos) {
+    assert(pos <= Mask);
+    for (size_t bin = begin; bin != end; ++bin)
+      table_[Index(node, bin)] = Leaf | static_cast<unsigned>(pos);
+  }
+
+  // Puts a new root on top, which covers `num_bins_` times the range.
+  void GrowRoot(size_t pos) {
+    const size_t root = AddNode(pos);
+    table_[Index(root, 0)] = static_cast<unsigned>(root_);
+    root_ = root;
+    shift_ += log_num_bins_;
+    path_.insert(path_.begin(), {root_, 0});
+    ++num_levels_;
+  }
+
+  // Splits the leaf of the last key, whose keys start at `begin`, until the
+  // leaf of the last key has at most `max_error_` keys. Only the last bin of
+  // a new node can have more keys than its parent's leaf had minus one.
+  void Split(size_t begin) {
+    while (keys_.size() - begin > max_error_) {
+      const size_t level = path_.size() - 1;
+      // Corner-case: a bin of a single key (only with duplicates).
+      if (Width(level) == 0) return;
+
+      const size_t child = AddNode(begin);
+      table_[Index(path_[level].node, path_[level].bin)] =
+          static_cast<unsigned>(child);
+      path_.push_back({child, 0});
+      num_levels_ = std::max(num_levels_, path_.size());
+
+      // Set the partial sums of the bins, as in `Builder::InitNode`.
+      size_t bin = BinOf(keys_[begin], level + 1);
+      SetLeaves(child, 0, bin + 1, begin);
+      for (size_t index = begin + 1; index != keys_.size(); ++index) {
+        const auto next = BinOf(keys_[index], level + 1);
+        if (next == bin) continue;
+        SetLeaves(child, bin + 1, next + 1, index);
+        bin = next;
+        begin = index;
+      }
+      path_.back().bin = bin;
+    }
+  }
+
+  size_t Lookup(KeyType key) const {
+    // Edge cases
+    if (keys_.empty() || key <= keys_.front()) return 0;
+    // The last key may be duplicated, so its own lookup walks the tree.
+    if (key > keys_.back()) return keys_.size() - 1;
+
+    size_t next = root_;
+    for (size_t level = 0;; ++level) {
+      next = table_[Index(next, BinOf(key, level))];
+
+      // Is it a leaf?
+      if (next & Leaf) return next & Mask;
+    }
+  }
+
+  KeyType min_key_;
+  size_t num_bins_;
+  unsigned log_num_bins_;
+  size_t max_error_;
+  unsigned shift_ = 0;
+  size_t root_ = 0;
+  size_t num_levels_ = 1;
+
+  // The nodes, each with `num_bins_` entries as in `CompactHistTree`.
+  std::vector<unsigned> table_;
+  // The path of the last key from the root.
+  std::vector<PathStep> path_;
+  std::vector<KeyType> keys_;
+};
+
+}  // namespace cht
@@ -0,0 +1,110 @@
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <cstddef>
+#include <memory>
+#include <vector>
+
+namespace cht {
+
+// Stores the nodes of a tree under construction, each with its `Info` and
+// its `num_bins` bins. The nodes are addressed by index and live in slabs of
+// a fixed number of nodes, so adding a node never moves the existing ones and
+// only allocates once per slab.
+template <class Info, class Bin>
+class NodeArena {
+ public:
+  explicit NodeArena(size_t num_bins)
+      : num_bins_(num_bins),
+        log_nodes_per_slab_(ComputeLogNodesPerSlab(num_bins)) {}
+
+  size_t size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+
+  Info& info(size_t node) { return SlabOf(node).infos[Offset(node)]; }
+  const Info& info(size_t node) const {
+    return SlabOf(node).infos[Offset(node)];
+  }
+
+  // Returns the `num_bins` bins of `node`.
+  Bin* bins(size_t node) {
+    return SlabOf(node).bins.get() + Offset(node) * num_bins_;
+  }
+  const Bin* bins(size_t node) const {
+    return SlabOf(node).bins.get() + Offset(node) * num_bins_;
+  }
+
+  // Appends a node whose bins are all set to `bin`, and returns its index.
+  size_t Add(const Info& info, const Bin& bin) {
+    Resize(size_ + 1);
+    const size_t node = size_ - 1;
+    this->info(node) = info;
+    std::fill(bins(node), bins(node) + num_bins_, bin);
+    return node;
+  }
+
+  // Appends a copy of `other.info(node)` and its bins, and returns its index.
+  size_t Add(const NodeArena& other, size_t node) {
+    assert(other.num_bins_ == num_bins_);
+    Resize(size_ + 1);
+    info(size_ - 1) = other.info(node);
+    std::copy(other.bins(node), other.bins(node) + num_bins_,
+              bins(size_ - 1));
+    return size_ - 1;
+  }
+
+  // Grows the arena to `size` nodes. Since the slabs are allocated here,
+  // threads can afterwards fill distinct nodes concurrently.
+  void Resize(size_t size) {
+    const size_t nodesPerSlab = size_t(1) << log_nodes_per_slab_;
+    while (slabs_.size() * nodesPerSlab < size) {
+      slabs_.push_back({std::make_unique<Info[]>(nodesPerSlab),
+                        std::make_unique<Bin[]>(nodesPerSlab * num_bins_)});
+    }
+    size_ = std::max(size_, size);
+  }
+
+  // Releases all nodes.
+  void Clear() {
+    slabs_.clear();
+    slabs_.shrink_to_fit();
+    size_ = 0;
+  }
+
+  // Returns the number of bytes allocated for the nodes.
+  size_t GetAllocatedBytes() const {
+    const size_t nodesPerSlab = size_t(1) << log_nodes_per_slab_;
+    return slabs_.capacity() * sizeof(Slab) +
+           slabs_.size() * nodesPerSlab *
+               (sizeof(Info) + num_bins_ * sizeof(Bin));
+  }
+
+ private:
+  struct Slab {
+    std::unique_ptr<Info[]> infos;
+    std::unique_ptr<Bin[]> bins;
+  };
+
+  // The slabs hold at least 4096 bins, and at least one node.
+  static unsigned ComputeLogNodesPerSlab(size_t num_bins) {
+    unsigned lg = 0;
+    while ((num_bins << lg) < 4096) ++lg;
+    return lg;
+  }
+
+  Slab& SlabOf(size_t node) { return slabs_[node >> log_nodes_per_slab_]; }
+  const Slab& SlabOf(size_t node) const {
+    return slabs_[node >> log_nodes_per_slab_];
+  }
+  size_t Offset(size_t node) const {
+    return node & ((size_t(1) << log_nodes_per_slab_) - 1);
+  }
+
+  size_t num_bins_;
+  unsigned log_nodes_per_slab_;
+  size_t size_ = 0;
+  std::vector<Slab> slabs_;
+};
+
+}  // namespace cht
@@ -1,9 +1,15 @@
 #pragma once
 
+#include <algorithm>
+#include <atomic>
 #include <cassert>
 #include <cmath>
+#include <functional>
+#include <iostream>
 #include <limits>
+#include <thread>
 
+#include "arena.h"
 #include "cht.h"
 #include "common.h"
 
@@ -15,17 +21,21 @@ class Builder {
  public:
   // The cache-oblivious structure makes sense when the tree becomes deep
   // (`numBins` or `maxError` become small)
+  // `num_threads` is the number of threads used by the offline build.
   Builder(KeyType min_key, KeyType max_key, size_t num_bins, size_t max_error,
-          bool single_pass = false, bool use_cache = false)
+          bool single_pass = false, bool use_cache = false,
+          size_t num_threads = 1)
       : min_key_(min_key),
         max_key_(max_key),
         num_bins_(num_bins),
         log_num_bins_(computeLog(static_cast<uint64_t>(num_bins_))),
         max_error_(max_error),
-        single_pass_(use_cache ? false : single_pass),
+        single_pass_(single_pass),
         use_cache_(use_cache),
+        num_threads_(std::max<size_t>(num_threads, 1)),
         curr_num_keys_(0),
-        prev_key_(min_key) {
+        prev_key_(min_key),
+        tree_(num_bins) {
     assert((num_bins_ & (num_bins_ - 1)) == 0);
     // Compute the logarithm in base 2 of the range.
     auto lg = computeLog(max_key_ - min_key_, true);
@@ -33,11 +43,6 @@ class Builder {
     // And also the initial shift for the first node of the tree.
     assert(lg >= log_num_bins_);
     shift_ = lg - log_num_bins_;
-
-    if ((use_cache) && (single_pass))
-      std::cerr << "Cache-oblivious and single-pass not supported yet! In this "
-                   "case it will ignore the single-pass option."
-                << std::endl;
   }
 
   // Adds a key. Assumes that keys are stored in a dense array.
@@ -46,50 +51,157 @@ class Builder {
     // Keys need to be monotonically increasing.
     assert(key >= prev_key_);
 
-    if (!single_pass_)
+    if (!single_pass_) {
       keys_.push_back(key);
-    else
+      if (keys_.size() == keys_.capacity()) UpdatePeakBytes();
+    } else {
       IncrementTable(key);
+    }
 
     ++curr_num_keys_;
     prev_key_ = key;
   }
 
+  // Builds the tree over the `num_keys` sorted `keys`, instead of `AddKey`
+  // and `Finalize`. The offline build reads the keys in place rather than
+  // copying them, so they only need to stay valid during the call.
+  CompactHistTree<KeyType> Build(const KeyType* keys, size_t num_keys) {
+    return BuildStrided(keys, num_keys, sizeof(KeyType));
+  }
+
+  // Same, for keys stored in the member `key_member` of the sorted `rows`.
+  template <class Row>
+  CompactHistTree<KeyType> Build(const Row* rows, size_t num_rows,
+                                 KeyType Row::*key_member) {
+    return BuildStrided(num_rows ? &(rows->*key_member) : nullptr, num_rows,
+                        sizeof(Row));
+  }
+
   // Finalizes the construction and returns a read-only `RadixSpline`.
   CompactHistTree<KeyType> Finalize() {
     // Last key needs to be equal to `max_key_`.
     assert((!curr_num_keys_) || (prev_key_ == max_key_));
+    if (!key_data_) SetKeys(keys_.data(), sizeof(KeyType));
 
+    if (max_log_num_bins_) return FinalizeAdaptive();
     if (!single_pass_) {
       BuildOffline();
-
-      if (!use_cache_) {
-        Flatten();
-      } else {
-        CacheObliviousFlatten();
-      }
-    } else {
-      PruneAndFlatten();
+    } else if (use_cache_) {
+      PruneTree();
     }
 
-    return CompactHistTree<KeyType>(min_key_, max_key_, curr_num_keys_,
-                                    num_bins_, log_num_bins_, max_error_,
-                                    shift_, std::move(table_));
+    // The partial sums and the node indices need to fit into the entries. In
+    // the single-pass build without the cache-oblivious layout, the number of
+    // nodes is the one before pruning.
+    using Narrow = EntryTraits<unsigned>;
+    if (force_wide_entries_ || curr_num_keys_ > Narrow::Mask ||
+        tree_.size() > Narrow::Mask)
+      return FinalizeTable<uint64_t>();
+    // The chain pointers hold entry offsets, below the `Chain` flag.
+    if (path_compression_ &&
+        tree_.size() * (num_bins_ + ChainHeader<unsigned>::Size) >
+            Narrow::ChainMask)
+      return FinalizeTable<uint64_t>();
+    return FinalizeTable<unsigned>();
+  }
+
+  // Returns the peak number of bytes allocated by the builder for the keys,
+  // the nodes and the table.
+  size_t GetPeakBytes() const { return peak_bytes_; }
+
+  // Makes `Finalize` use 64-bit table entries even if the 32-bit ones
+  // suffice, which is otherwise only the case beyond 2^31 keys or nodes.
+  void ForceWideEntries() { force_wide_entries_ = true; }
+
+  // Makes `Finalize` allocate the table with regular pages. By default, a
+  // table of at least 2MB is advised to use transparent huge pages.
+  void DisableHugePages() { huge_pages_ = false; }
+
+  // Makes the search bounds of the tree end at the partial sum of the next
+  // bin, if it is a leaf of the same node, instead of always spanning
+  // `max_error + 1` keys. Since most bins hold far fewer keys than
+  // `max_error`, this shrinks the search over the bound at the cost of
+  // reading the next entry, which is mostly in the same cache line.
+  void UseTightBounds() { tight_bounds_ = true; }
+
+  // Makes the lookups interpolate the position of a key between the partial
+  // sums of its bin and the next one, and search only within the largest
+  // error of the interpolation in its node. The errors are computed from the
+  // keys and stored in 16 bits per node, so larger bins, i.e. a larger
+  // `max_error` and a smaller tree, need not widen the search. This implies
+  // `UseTightBounds`, and needs the offline build in the uniform layout.
+  void UseInterpolation() {
+    assert(!single_pass_ && !max_log_num_bins_ && !path_compression_);
+    tight_bounds_ = true;
+    interpolation_ = true;
+  }
+
+  // Makes `Finalize` choose the fanout of each node from its number of keys
+  // and its range, up to `max_num_bins`, instead of using `num_bins` for all
+  // nodes. The tree then has the adaptive layout. Since the fanouts depend
+  // on the keys, this needs the offline build in the BFS layout.
+  void UseAdaptiveFanout(size_t max_num_bins) {
+    assert(!single_pass_ && !use_cache_ && !path_compression_);
+    assert(num_root_nodes_ == 1 && !interpolation_);
+    assert(max_num_bins >= 2 && (max_num_bins & (max_num_bins - 1)) == 0);
+    max_log_num_bins_ = computeLog(static_cast<uint64_t>(max_num_bins));
+  }
+
+  // Makes `Finalize` collapse the chains of nodes whose keys all fall into a
+  // single bin, which narrow key ranges produce. A lookup then skips such a
+  // chain with a single access. The tree has the compressed layout. This
+  // needs the offline build in the BFS layout.
+  void UsePathCompression() {
+    assert(!single_pass_ && !use_cache_ && !max_log_num_bins_ &&
+           !interpolation_);
+    path_compression_ = true;
+  }
+
+  // Makes the root have `root_num_bins` bins, at most one per key of the
+  // range, while the other nodes keep `num_bins`. A root sized for the L2 or
+  // L3 cache replaces the top levels of the tree, i.e. their cache misses,
+  // without the memory of a large fanout everywhere. The root is stored as
+  // the first `root_num_bins / num_bins` nodes of the uniform layout, which
+  // the lookups then index as a single node. This needs the offline build in
+  // the BFS layout.
+  void UseRootFanout(size_t root_num_bins) {
+    assert(!single_pass_ && !use_cache_ && !max_log_num_bins_);
+    assert(root_num_bins >= num_bins_ &&
+           (root_num_bins & (root_num_bins - 1)) == 0);
+    const unsigned lg = computeLog(max_key_ - min_key_, true);
+    const unsigned rootLog = std::min<unsigned>(
+        computeLog(static_cast<uint64_t>(root_num_bins)), lg);
+    if (rootLog == log_num_bins_) return;
+
+    // The root consists of nodes at level 1, whose bins have the width of
+    // the root bins.
+    num_root_nodes_ = size_t(1) << (rootLog - log_num_bins_);
+    root_level_ = 1;
+    shift_ = lg - rootLog + log_num_bins_;
   }
 
  private:
-  static constexpr unsigned Infinity = std::numeric_limits<unsigned>::max();
-  static constexpr unsigned Leaf = (1u << 31);
-  static constexpr unsigned Mask = Leaf - 1;
+  static constexpr size_t Infinity = std::numeric_limits<size_t>::max();
+  // Marks the bins of `tree_` which are leaves. The table entries have their
+  // own leaf flag, depending on their width.
+  static constexpr size_t Leaf = (1ull << 63);
+  static constexpr size_t Mask = Leaf - 1;
 
   // Range covered by a node, i.e. [l, r[
-  using Range = std::pair<unsigned, unsigned>;
+  using Range = std::pair<size_t, size_t>;
 
   // (Node level, smallest key in node)
   using Info = std::pair<unsigned, KeyType>;
 
   // A queue element
-  using Elem = std::pair<unsigned, Range>;
+  using Elem = std::pair<size_t, Range>;
+
+  // The nodes of the tree under construction.
+  using Tree = NodeArena<Info, Range>;
+
+  // The parallel build splits the top of the tree until there are this many
+  // subtrees per thread, to balance skewed key distributions.
+  static constexpr size_t kSubtreesPerThread = 8;
 
   static unsigned computeLog(uint32_t n, bool round = false) {
     assert(n);
@@ -101,243 +213,654 @@ class Builder {
     return 63 - __builtin_clzl(n) + (round ? ((n & (n - 1)) != 0) : 0);
   }
 
+  // Builds over the `num_keys` keys which are `stride` bytes apart, starting
+  // at `keys`.
+  CompactHistTree<KeyType> BuildStrided(const KeyType* keys, size_t num_keys,
+                                        size_t stride) {
+    assert(!curr_num_keys_);
+    SetKeys(keys, stride);
+    if (single_pass_) {
+      for (size_t index = 0; index != num_keys; ++index) AddKey(Key(index));
+    } else if (num_keys) {
+      assert(Key(0) >= min_key_ && Key(num_keys - 1) <= max_key_);
+      curr_num_keys_ = num_keys;
+      prev_key_ = Key(num_keys - 1);
+    }
+    auto cht = Finalize();
+    // The keys belong to the caller.
+    SetKeys(nullptr, sizeof(KeyType));
+    return cht;
+  }
+
+  void SetKeys(const KeyType* keys, size_t stride) {
+    key_data_ = reinterpret_cast<const char*>(keys);
+    key_stride_ = stride;
+  }
+
+  // Returns the key at `index` of the offline build.
+  KeyType Key(size_t index) const {
+    return *reinterpret_cast<const KeyType*>(key_data_ + index * key_stride_);
+  }
+
+  // Accounts the memory of the keys and the nodes, plus `extra` bytes of
+  // temporary allocations, towards the peak.
+  void UpdatePeakBytes(size_t extra = 0) {
+    peak_bytes_ = std::max(peak_bytes_, keys_.capacity() * sizeof(KeyType) +
+                                            tree_.GetAllocatedBytes() + extra);
+  }
+
   void IncrementTable(KeyType key) {
     const auto Insert = [&]() -> void {
       // Traverse the tree from root.
-      for (unsigned level = 0, nodeIndex = 0; (shift_ >= level * log_num_bins_);
-           ++level) {
-        const auto [_, lower] = tree_[nodeIndex].first;
+      size_t nodeIndex = 0;
+      for (unsigned level = 0; (shift_ >= level * log_num_bins_); ++level) {
+        const auto [_, lower] = tree_.info(nodeIndex);
         // Compute the width and the bin for this node
         unsigned width = shift_ - level * log_num_bins_;
         auto bin = (key - min_key_ - lower) >> width;
 
-        // Did we already visit this node?
-        if (tree_[nodeIndex].second[bin].first != Infinity) {
-          assert(tree_[nodeIndex].second[bin].second != Infinity);
-          nodeIndex = tree_[nodeIndex].second[bin].second;
+        // Did we already visit this node? Without a next node, the bin is at
+        // the last level and already holds a previous copy of the key.
+        if (tree_.bins(nodeIndex)[bin].first != Infinity) {
+          if (tree_.bins(nodeIndex)[bin].second == Infinity) return;
+          nodeIndex = tree_.bins(nodeIndex)[bin].second;
           continue;
         }
 
         // No? Then set the partial sums, which will remain unchanged for this
         // particular node.
-        tree_[nodeIndex].second[bin].first = curr_num_keys_;
+        tree_.bins(nodeIndex)[bin].first = curr_num_keys_;
 
         // Can we continue with the next level?
         if (shift_ >= (level + 1) * log_num_bins_) {
-          // Create the new node
-          std::vector<Range> newNode;
-          newNode.assign(num_bins_, {Infinity, Infinity});
-
-          // Compute the lowest key and attach the new node to the bin.
+          // Create the new node, with the lowest key of the bin.
           const auto newLower = lower + bin * (1ull << width);
-          tree_.push_back({{level + 1, newLower}, newNode});
+          const auto newNode =
+              tree_.Add({level + 1, newLower}, {Infinity, Infinity});
 
           // Point to the new node.
-          tree_[nodeIndex].second[bin].second = tree_.size() - 1;
-          nodeIndex = tree_.size() - 1;
+          tree_.bins(nodeIndex)[bin].second = newNode;
+          nodeIndex = newNode;
         }
       }
     };
 
-    if (!curr_num_keys_)
-      tree_.push_back(
-          {{0, 0}, std::vector<Range>(num_bins_, {Infinity, Infinity})});
+    if (!curr_num_keys_) tree_.Add({0, 0}, {Infinity, Infinity});
+    const auto prevBytes = tree_.GetAllocatedBytes();
     Insert();
+    if (tree_.GetAllocatedBytes() != prevBytes) UpdatePeakBytes();
   }
 
-  void PruneAndFlatten() {
+  // Prunes the tree of the single-pass build: bins with at most `max_error`
+  // keys become leaves. Calls `visit(nodeIndex, bins)` for the remaining nodes
+  // in BFS order, with their bins in the format of the offline build, i.e.
+  // the pointers are BFS indices.
+  template <class Visit>
+  void Prune(Visit visit) {
     // Init the helpers.
     std::queue<Elem> nodes;
-    std::vector<unsigned> mapping(tree_.size(), Infinity);
-    unsigned curr = 0;
+    std::vector<Range> bins(num_bins_);
+    size_t numNodes = 1;
 
     // Init the node, which covers the range `curr` := [a, b[.
-    const auto AnalyzeNode = [&](unsigned nodeIndex, Range curr) -> void {
-      std::vector<unsigned> tmp(num_bins_, 0);
-      unsigned b = curr.second;
+    const auto AnalyzeNode = [&](size_t nodeIndex, Range curr) -> void {
+      size_t b = curr.second;
       for (unsigned backIndex = num_bins_; backIndex; --backIndex) {
         const auto bin = backIndex - 1;
 
         // Empty bin?
-        if (tree_[nodeIndex].second[bin].first == Infinity) {
+        if (tree_.bins(nodeIndex)[bin].first == Infinity) {
           // Then mark it as a leaf which points to the upper bound.
-          tmp[bin] = b | Leaf;
+          bins[bin] = {b | Leaf, 0};
           continue;
         }
 
         // Is it a leaf in the original tree, i.e. at the next level the width
         // would have become negative?
-        if (tree_[nodeIndex].second[bin].second == Infinity) {
+        if (tree_.bins(nodeIndex)[bin].second == Infinity) {
           // Mark as leaf, even though it could cover more than `max_error` keys
           // (this can only happen for datasets with duplicates)
-          tmp[bin] = tree_[nodeIndex].second[bin].first | Leaf;
+          bins[bin] = {tree_.bins(nodeIndex)[bin].first | Leaf, 0};
           continue;
         }
 
         // Is this bin responsible for more than `max_error` keys?
-        const auto firstPos = tree_[nodeIndex].second[bin].first;
+        const auto firstPos = tree_.bins(nodeIndex)[bin].first;
         if (b - firstPos > max_error_) {
-          // Push the next node into the queue
-          const unsigned nextNode = tree_[nodeIndex].second[bin].second;
-          nodes.push({nextNode, {firstPos, b}});
-
-          // And add the pointer in the table. We postpone the mapping for
-          // later, once the BFS is finished.
-          tmp[bin] = nextNode;
+          // Keep the range of the next node, which is pushed below.
+          bins[bin] = {firstPos, b};
         } else {
           // No, then mark it as a leaf which points to the lower bound.
-          tmp[bin] = firstPos | Leaf;
+          bins[bin] = {firstPos | Leaf, 0};
         }
 
         // Reset the last position.
         b = firstPos;
       }
 
-      // And update the table.
-      table_.insert(table_.end(), tmp.begin(), tmp.end());
+      // Push the next nodes into the queue in the order of their bins, as in
+      // the offline build, and point to their BFS indices.
+      for (unsigned bin = 0; bin != num_bins_; ++bin) {
+        if (bins[bin].first & Leaf) continue;
+        nodes.push({tree_.bins(nodeIndex)[bin].second, bins[bin]});
+        bins[bin] = {0, numNodes++};
+      }
     };
 
-    // Traverse the tree and fill the table with BFS.
+    // Traverse the tree with BFS.
     nodes.push({0, {0, curr_num_keys_}});
     while (!nodes.empty()) {
       const auto elem = nodes.front();
       nodes.pop();
-      mapping[elem.first] = curr++;
       AnalyzeNode(elem.first, elem.second);
+      visit(elem.first, bins.data());
     }
-    assert(table_.size() == static_cast<size_t>(curr) * num_bins_);
+  }
 
-    // And update the pointers with their mapping.
-    for (size_t index = 0, limit = curr; index != limit; ++index) {
-      assert(mapping[index] != Infinity);
-      for (unsigned bin = 0; bin != num_bins_; ++bin) {
-        if ((table_[(index << log_num_bins_) + bin] & Leaf) == 0)
-          table_[(index << log_num_bins_) + bin] = mapping[table_[(index << log_num_bins_) + bin]];
+  // Prunes and flattens the tree of the single-pass build.
+  template <class Entry>
+  TableVector<Entry> PruneAndFlatten() {
+    auto table = NewTable<Entry>();
+    const auto identity = [](size_t index) { return index; };
+    Prune([&](size_t, const Range* bins) -> void {
+      for (unsigned bin = 0; bin != num_bins_; ++bin)
+        table.push_back(ToEntry<Entry>(bins[bin], identity));
+      if (table.size() == table.capacity())
+        UpdatePeakBytes(table.capacity() * sizeof(Entry));
+    });
+    tree_.Clear();
+    return table;
+  }
+
+  // Replaces the tree of the single-pass build with its pruned version, in
+  // the format of the offline build. This allows the single-pass build to
+  // use the cache-oblivious layout without ever buffering the keys.
+  void PruneTree() {
+    Tree pruned(num_bins_);
+    Prune([&](size_t nodeIndex, const Range* bins) -> void {
+      const auto node = pruned.Add(tree_.info(nodeIndex), {0, 0});
+      std::copy(bins, bins + num_bins_, pruned.bins(node));
+    });
+    UpdatePeakBytes(pruned.GetAllocatedBytes());
+    tree_ = std::move(pruned);
+  }
+
+  // Init the node `tree[nodeIndex]`, which covers the range `curr` := [a, b[.
+  void InitNode(Tree& tree, size_t nodeIndex, Range curr) const {
+    // Compute `width` of the current node (2^`width` represents the range
+    // covered by a single bin).
+    std::optional<unsigned> currBin = std::nullopt;
+    unsigned width = shift_ - tree.info(nodeIndex).first * log_num_bins_;
+
+    // And compute the bins
+    for (size_t index = curr.first; index != curr.second; ++index) {
+      // Extract the bin of the current key.
+      auto bin =
+          (Key(index) - min_key_ - tree.info(nodeIndex).second) >> width;
+
+      // Is the first bin or a new one?
+      if ((!currBin.has_value()) || (bin != currBin.value())) {
+        // Iterate the bins which have not been touched and set for them an
+        // empty range.
+        for (unsigned iter = currBin.has_value() ? (currBin.value() + 1) : 0;
+             iter != bin; ++iter) {
+          tree.bins(nodeIndex)[iter] = {index, index};
+        }
+
+        // Init the current bin.
+        tree.bins(nodeIndex)[bin] = {index, index};
+        currBin = bin;
       }
+
+      // And increase the range of the current bin.
+      tree.bins(nodeIndex)[bin].second++;
     }
-    tree_.clear();
+    assert(tree.bins(nodeIndex)[currBin.value()].second == curr.second);
   }
 
-  void BuildOffline() {
-    // Init the node, which covers the range `curr` := [a, b[.
-    auto initNode = [&](unsigned nodeIndex, Range curr) -> void {
-      // Compute `width` of the current node (2^`width` represents the range
-      // covered by a single bin).
-      std::optional<unsigned> currBin = std::nullopt;
-      unsigned width = shift_ - tree_[nodeIndex].first.first * log_num_bins_;
-
-      // And compute the bins
-      for (unsigned index = curr.first; index != curr.second; ++index) {
-        // Extract the bin of the current key.
-        auto bin =
-            (keys_[index] - min_key_ - tree_[nodeIndex].first.second) >> width;
-
-        // Is the first bin or a new one?
-        if ((!currBin.has_value()) || (bin != currBin.value())) {
-          // Iterate the bins which have not been touched and set for them an
-          // empty range.
-          for (unsigned iter = currBin.has_value() ? (currBin.value() + 1) : 0;
-               iter != bin; ++iter) {
-            tree_[nodeIndex].second[iter] = {index, index};
-          }
-
-          // Init the current bin.
-          tree_[nodeIndex].second[bin] = {index, index};
-          currBin = bin;
+  // Consider each bin of `tree[node]` and decide whether we should split it.
+  // The children are appended to `tree` in the order of their bins.
+  void SplitNode(Tree& tree, size_t node) const {
+    unsigned level = tree.info(node).first;
+    KeyType lower = tree.info(node).second;
+    for (unsigned bin = 0; bin != num_bins_; ++bin) {
+      // Should we split further?
+      if (tree.bins(node)[bin].second - tree.bins(node)[bin].first >
+          max_error_) {
+        // Corner-case: is #keys > range? Then create a leaf (this can only
+        // happen for datasets with duplicates).
+        auto size = tree.bins(node)[bin].second -
+                    tree.bins(node)[bin].first;
+        if (size > (1ull << (shift_ - level * log_num_bins_))) {
+          tree.bins(node)[bin].first |= Leaf;
+          continue;
         }
 
-        // And increase the range of the current bin.
-        tree_[nodeIndex].second[bin].second++;
+        // Add the next node to the tree.
+        auto newLower =
+            lower + bin * (1ull << (shift_ - level * log_num_bins_));
+        const auto newNode =
+            tree.Add({level + 1, newLower}, {tree.bins(node)[bin].second,
+                                             tree.bins(node)[bin].second});
+
+        // Init it
+        InitNode(tree, newNode, tree.bins(node)[bin]);
+
+        // Reset this node (no leaf, pointer to child).
+        tree.bins(node)[bin] = {0, newNode};
+      } else {
+        // Leaf
+        tree.bins(node)[bin].first |= Leaf;
       }
-      assert(tree_[nodeIndex].second[currBin.value()].second == curr.second);
+    }
+  }
+
+  // Runs `func(index)` for each index in [0, `count`[ on `num_threads_`
+  // threads.
+  template <class Func>
+  void ParallelFor(size_t count, Func func) const {
+    std::atomic<size_t> next(0);
+    const auto work = [&]() -> void {
+      for (size_t index; (index = next.fetch_add(1)) < count;) func(index);
     };
+    std::vector<std::thread> threads;
+    for (size_t index = 1; index < num_threads_; ++index)
+      threads.emplace_back(work);
+    work();
+    for (auto& thread : threads) thread.join();
+  }
+
+  // Adds the nodes of the root. With `UseRootFanout`, these are the nodes of
+  // level 1 which cover consecutive ranges.
+  void InitRoot() {
+    if (num_root_nodes_ == 1) {
+      tree_.Add({0, 0}, {curr_num_keys_, curr_num_keys_});
+      InitNode(tree_, 0, {0, curr_num_keys_});
+      return;
+    }
+    size_t begin = 0;
+    for (size_t node = 0; node != num_root_nodes_; ++node) {
+      const KeyType lower = static_cast<KeyType>(node) << shift_;
+      size_t end = begin;
+      while (end != curr_num_keys_ &&
+             ((Key(end) - min_key_) >> shift_) == node)
+        ++end;
+      tree_.Add({root_level_, lower}, {end, end});
+      if (begin != end) InitNode(tree_, node, {begin, end});
+      begin = end;
+    }
+  }
 
-    // Init the first node.
-    tree_.push_back(
-        {{0, 0},
-         std::vector<Range>(num_bins_, {curr_num_keys_, curr_num_keys_})});
-    initNode(0, {0, curr_num_keys_});
+  void BuildOffline() {
+    // Init the root.
+    InitRoot();
+
+    // Run the BFS. Since the children are appended in the order in which
+    // their parents are split, the queue is the suffix of `tree_`.
+    if (num_threads_ <= 1) {
+      for (size_t node = 0; node != tree_.size(); ++node)
+        SplitNode(tree_, node);
+      UpdatePeakBytes();
+      return;
+    }
 
-    // Run the BFS
-    std::queue<unsigned> nodes;
-    nodes.push(0);
-    while (!nodes.empty()) {
-      // Extract from the queue.
-      auto node = nodes.front();
-      nodes.pop();
+    // Split the top levels, until there are enough independent subtrees.
+    size_t begin = 0, end = tree_.size();
+    while ((begin != end) && (end - begin < kSubtreesPerThread * num_threads_)) {
+      for (size_t node = begin; node != end; ++node) SplitNode(tree_, node);
+      begin = end, end = tree_.size();
+    }
+    if (begin == end) {
+      UpdatePeakBytes();
+      return;
+    }
 
-      // Consider each bin and decide whether we should split it.
-      unsigned level = tree_[node].first.first;
-      KeyType lower = tree_[node].first.second;
-      for (unsigned bin = 0; bin != num_bins_; ++bin) {
-        // Should we split further?
-        if (tree_[node].second[bin].second - tree_[node].second[bin].first >
-            max_error_) {
-          // Corner-case: is #keys > range? Then create a leaf (this can only
-          // happen for datasets with duplicates).
-          auto size = tree_[node].second[bin].second -
-                      tree_[node].second[bin].first;
-          if (size > (1ull << (shift_ - level * log_num_bins_))) {
-            tree_[node].second[bin].first |= Leaf;
-            continue;
-          }
+    // Build the subtrees of the frontier [`begin`, `end`[ in parallel.
+    const size_t numSubtrees = end - begin;
+    std::vector<Tree> subtrees;
+    subtrees.reserve(numSubtrees);
+    for (size_t index = 0; index != numSubtrees; ++index)
+      subtrees.emplace_back(num_bins_);
+    ParallelFor(numSubtrees, [&](size_t index) {
+      auto& subtree = subtrees[index];
+      subtree.Add(tree_, begin + index);
+      for (size_t node = 0; node != subtree.size(); ++node)
+        SplitNode(subtree, node);
+    });
+
+    // Stitch the subtrees back into the BFS order of the serial build. Within
+    // a level, the nodes of the serial BFS are ordered by their subtree, so a
+    // node's index is the start of its level, plus the number of nodes on
+    // that level in the previous subtrees, plus its rank within its subtree.
+    const unsigned frontierLevel = subtrees[0].info(0).first;
+    std::vector<std::vector<size_t>> counts(numSubtrees);
+    unsigned numLevels = 0;
+    size_t subtreeBytes = 0;
+    for (size_t index = 0; index != numSubtrees; ++index) {
+      subtreeBytes += subtrees[index].GetAllocatedBytes();
+      for (size_t node = 0; node != subtrees[index].size(); ++node) {
+        const unsigned level =
+            subtrees[index].info(node).first - frontierLevel;
+        if (level >= counts[index].size()) counts[index].resize(level + 1, 0);
+        ++counts[index][level];
+      }
+      numLevels = std::max(numLevels,
+                           static_cast<unsigned>(counts[index].size()));
+    }
 
-          // Alloc the next node.
-          std::vector<Range> newNode;
-          newNode.assign(num_bins_, {tree_[node].second[bin].second,
-                                     tree_[node].second[bin].second});
+    // `offsets[index][level]` is the index in `tree_` of the first node of
+    // subtree `index` on `level`.
+    std::vector<std::vector<size_t>> offsets(
+        numSubtrees, std::vector<size_t>(numLevels, 0));
+    size_t curr = begin;
+    for (unsigned level = 0; level != numLevels; ++level) {
+      for (size_t index = 0; index != numSubtrees; ++index) {
+        offsets[index][level] = curr;
+        if (level < counts[index].size()) curr += counts[index][level];
+      }
+    }
+    tree_.Resize(curr);
+    UpdatePeakBytes(subtreeBytes);
+
+    ParallelFor(numSubtrees, [&](size_t index) {
+      auto& subtree = subtrees[index];
+
+      // Map the local node indices to the global ones.
+      std::vector<size_t> mapping(subtree.size());
+      for (size_t node = 0, level = 0, rank = 0; node != subtree.size();
+           ++node, ++rank) {
+        if (subtree.info(node).first - frontierLevel != level) ++level, rank = 0;
+        mapping[node] = offsets[index][level] + rank;
+      }
 
-          // And add it to the tree.
-          auto newLower =
-              lower + bin * (1ull << (shift_ - level * log_num_bins_));
-          tree_.push_back({{level + 1, newLower}, newNode});
+      // And copy the nodes with their updated pointers.
+      for (size_t node = 0; node != subtree.size(); ++node) {
+        tree_.info(mapping[node]) = subtree.info(node);
+        const auto* bins = subtree.bins(node);
+        auto* target = tree_.bins(mapping[node]);
+        for (unsigned bin = 0; bin != num_bins_; ++bin) {
+          target[bin] = bins[bin];
+          if ((bins[bin].first & Leaf) == 0)
+            target[bin].second = mapping[bins[bin].second];
+        }
+      }
+      subtree.Clear();
+    });
+  }
 
-          // Init it
-          initNode(tree_.size() - 1, tree_[node].second[bin]);
+  // Returns the log of the fanout which spreads `size` keys over bins of
+  // `max_error_` keys on average. The fanout is at least 2, unless the range
+  // is a single key, and at most the range of `2^logRange` keys.
+  unsigned ChooseLogFanout(size_t size, unsigned logRange) const {
+    const size_t keysPerBin = std::max<size_t>(max_error_, 1);
+    unsigned lg = 1;
+    while (lg < max_log_num_bins_ && (keysPerBin << lg) < size) ++lg;
+    return std::min(lg, logRange);
+  }
+
+  // Builds the adaptive layout in BFS order and returns the tree.
+  CompactHistTree<KeyType> FinalizeAdaptive() {
+    // The root covers the smallest aligned range containing all keys.
+    const uint64_t range = max_key_ - min_key_;
+    const unsigned logRange = range ? computeLog(range) + 1 : 0;
+    const unsigned rootLog = ChooseLogFanout(curr_num_keys_, logRange);
+    auto table = BuildAdaptive(logRange, rootLog);
+
+    // The partial sums and the offsets need to fit into the entries.
+    using Narrow = EntryTraits<unsigned>;
+    auto narrow = NewTable<unsigned>();
+    if (!force_wide_entries_ && curr_num_keys_ <= Narrow::Mask &&
+        table.size() <= Narrow::OffsetMask) {
+      using Wide = EntryTraits<uint64_t>;
+      narrow.resize(table.size());
+      UpdatePeakBytes(table.capacity() * sizeof(uint64_t) +
+                      narrow.capacity() * sizeof(unsigned));
+      for (size_t index = 0; index != table.size(); ++index) {
+        const auto entry = table[index];
+        narrow[index] =
+            (entry & Wide::Leaf)
+                ? Narrow::Leaf | static_cast<unsigned>(entry & Wide::Mask)
+                : static_cast<unsigned>(
+                      ((entry >> Wide::FanoutShift) << Narrow::FanoutShift) |
+                      (entry & Wide::OffsetMask));
+      }
+    }
 
-          // Reset this node (no leaf, pointer to child).
-          tree_[node].second[bin] = {0, tree_.size() - 1};
+    if (narrow.empty()) {
+      return CompactHistTree<KeyType>(
+          min_key_, max_key_, curr_num_keys_, size_t(1) << rootLog, rootLog,
+          max_error_, logRange - rootLog, Table<uint64_t>(std::move(table)),
+          Layout::Adaptive, tight_bounds_);
+    }
+    return CompactHistTree<KeyType>(
+        min_key_, max_key_, curr_num_keys_, size_t(1) << rootLog, rootLog,
+        max_error_, logRange - rootLog, Table<unsigned>(std::move(narrow)),
+        Layout::Adaptive, tight_bounds_);
+  }
 
-          // And push it into the queue.
-          nodes.push(tree_.size() - 1);
+  // Builds the table of the adaptive layout with 64-bit entries. The nodes
+  // are visited in BFS order, and a node's entries are allocated when its
+  // parent is visited, so each node only needs to scan its own keys.
+  TableVector<uint64_t> BuildAdaptive(unsigned logRange, unsigned rootLog) {
+    using Wide = EntryTraits<uint64_t>;
+    struct Node {
+      Range range;
+      unsigned logRange;
+      unsigned logFanout;
+      size_t offset;
+    };
+    std::vector<Node> nodes{{{0, curr_num_keys_}, logRange, rootLog, 0}};
+    auto table = NewTable<uint64_t>(size_t(1) << rootLog);
+    for (size_t index = 0; index != nodes.size(); ++index) {
+      const auto node = nodes[index];
+      const unsigned width = node.logRange - node.logFanout;
+      const uint64_t numBins = uint64_t(1) << node.logFanout;
+
+      // Compute the bins, as in `InitNode`: an empty bin has an empty range
+      // at the next key.
+      size_t begin = node.range.first;
+      for (uint64_t bin = 0; bin != numBins; ++bin) {
+        size_t end = begin;
+        while (end != node.range.second &&
+               ((static_cast<uint64_t>(Key(end) - min_key_) >> width) &
+                (numBins - 1)) == bin)
+          ++end;
+
+        // Should we split further? A bin of a single key cannot be split
+        // (this can only happen for datasets with duplicates).
+        if (end - begin > max_error_ && width) {
+          const unsigned childLog = ChooseLogFanout(end - begin, width);
+          const size_t offset = table.size();
+          table.resize(offset + (size_t(1) << childLog));
+          nodes.push_back({{begin, end}, width, childLog, offset});
+          table[node.offset + bin] =
+              (uint64_t(childLog) << Wide::FanoutShift) | offset;
         } else {
-          // Leaf
-          tree_[node].second[bin].first |= Leaf;
+          table[node.offset + bin] = Wide::Leaf | begin;
         }
+        begin = end;
       }
     }
+    UpdatePeakBytes(table.capacity() * sizeof(uint64_t) +
+                    nodes.capacity() * sizeof(Node));
+    return table;
+  }
+
+  // Flattens the tree with `Entry`-wide table entries and returns it.
+  template <class Entry>
+  CompactHistTree<KeyType> FinalizeTable() {
+    TableVector<Entry> table;
+    if (single_pass_ && !use_cache_) {
+      table = PruneAndFlatten<Entry>();
+    } else if (path_compression_) {
+      table = CompressedFlatten<Entry>();
+    } else if (!use_cache_) {
+      table = Flatten<Entry>();
+    } else {
+      table = CacheObliviousFlatten<Entry>();
+    }
+
+    CompactHistTree<KeyType> cht(
+        min_key_, max_key_, curr_num_keys_, num_bins_, log_num_bins_,
+        max_error_, shift_ - root_level_ * log_num_bins_,
+        Table<Entry>(std::move(table)),
+        path_compression_ ? Layout::Compressed : Layout::Uniform,
+        tight_bounds_);
+    if (interpolation_ && curr_num_keys_)
+      cht.InterpolateLeaves([this](size_t index) { return Key(index); });
+    return cht;
+  }
+
+  // Returns a table of `size` entries, allocated as set by
+  // `DisableHugePages`.
+  template <class Entry>
+  TableVector<Entry> NewTable(size_t size = 0) const {
+    return TableVector<Entry>(size, TableAllocator<Entry>(huge_pages_));
+  }
+
+  // Converts a bin of `tree_` into a table entry. `order` maps the node
+  // indices to their position in the table.
+  template <class Entry, class Order>
+  static Entry ToEntry(const Range& range, const Order& order) {
+    // Leaf node? Then set the partial sum, otherwise the pointer.
+    if (range.first & Leaf)
+      return static_cast<Entry>(range.first & Mask) | EntryTraits<Entry>::Leaf;
+    return static_cast<Entry>(order(range.second));
   }
 
   // Flatten the layout of the tree.
-  void Flatten() {
-    table_.resize(static_cast<size_t>(tree_.size()) * num_bins_);
-    for (size_t index = 0, limit = tree_.size(); index != limit; ++index) {
+  template <class Entry>
+  TableVector<Entry> Flatten() {
+    auto table = NewTable<Entry>(tree_.size() * num_bins_);
+    UpdatePeakBytes(table.size() * sizeof(Entry));
+    const size_t numNodes = tree_.size();
+    const size_t numChunks =
+        num_threads_ <= 1 ? 1 : kSubtreesPerThread * num_threads_;
+    ParallelFor(numChunks, [&](size_t chunk) {
+      const size_t begin = chunk * numNodes / numChunks,
+                   end = (chunk + 1) * numNodes / numChunks;
+      const auto identity = [](size_t index) { return index; };
+      for (size_t index = begin; index != end; ++index) {
+        for (unsigned bin = 0; bin != num_bins_; ++bin) {
+          table[(index << log_num_bins_) + bin] =
+              ToEntry<Entry>(tree_.bins(index)[bin], identity);
+        }
+      }
+    });
+    return table;
+  }
+
+  // Flatten the tree in BFS order, and collapse its chains. A chain node has
+  // a single non-empty bin, which points to the next node. The pointer to the
+  // first node of a chain then points to a `ChainHeader`, which is placed
+  // after the remaining nodes.
+  template <class Entry>
+  TableVector<Entry> CompressedFlatten() {
+    using Traits = EntryTraits<Entry>;
+    using Header = ChainHeader<Entry>;
+    const size_t numNodes = tree_.size();
+
+    // Compute the key range of each node bottom-up, since the children come
+    // after their parents.
+    std::vector<Range> ranges(numNodes);
+    const auto rangeOf = [&](const Range& bin) -> Range {
+      return (bin.first & Leaf) ? Range(bin.first & Mask, bin.second)
+                                : ranges[bin.second];
+    };
+    for (size_t node = numNodes; node--;) {
+      ranges[node] = {rangeOf(tree_.bins(node)[0]).first,
+                      rangeOf(tree_.bins(node)[num_bins_ - 1]).second};
+    }
+
+    // Find the chain nodes, with their single child. The nodes of the root
+    // are always kept.
+    std::vector<size_t> chainChild(numNodes, Infinity);
+    for (size_t node = num_root_nodes_; node != numNodes; ++node) {
+      unsigned numNonEmpty = 0;
+      size_t child = Infinity;
       for (unsigned bin = 0; bin != num_bins_; ++bin) {
-        // Leaf node?
-        if (tree_[index].second[bin].first & Leaf) {
-          // Set the partial sum.
-          table_[(index << log_num_bins_) + bin] = tree_[index].second[bin].first;
-        } else {
-          // Set the pointer.
-          table_[(index << log_num_bins_) + bin] = tree_[index].second[bin].second;
+        const auto& range = tree_.bins(node)[bin];
+        if (!(range.first & Leaf)) {
+          child = range.second;
+          ++numNonEmpty;
+        } else if ((range.first & Mask) != range.second) {
+          ++numNonEmpty;
         }
       }
+      if (numNonEmpty == 1 && child != Infinity) chainChild[node] = child;
+    }
+
+    // Number the remaining nodes in BFS order.
+    std::vector<size_t> order(numNodes, Infinity);
+    size_t numKept = 0;
+    for (size_t node = 0; node != numNodes; ++node) {
+      if (chainChild[node] == Infinity) order[node] = numKept++;
     }
+
+    auto table = NewTable<Entry>(numKept << log_num_bins_);
+    for (size_t node = 0; node != numNodes; ++node) {
+      if (chainChild[node] != Infinity) continue;
+      const auto [level, lower] = tree_.info(node);
+      const unsigned width = shift_ - level * log_num_bins_;
+      for (unsigned bin = 0; bin != num_bins_; ++bin) {
+        const auto& range = tree_.bins(node)[bin];
+        const size_t index = (order[node] << log_num_bins_) + bin;
+        if ((range.first & Leaf) || chainChild[range.second] == Infinity) {
+          table[index] =
+              ToEntry<Entry>(range, [&](size_t child) { return order[child]; });
+          continue;
+        }
+
+        // Follow the chain to its last node.
+        const size_t first = range.second;
+        size_t last = first, numSkipped = 0;
+        while (chainChild[last] != Infinity) {
+          last = chainChild[last];
+          ++numSkipped;
+        }
+
+        // The prefix holds the bins of the skipped levels, relative to the
+        // lowest key of the bin.
+        const auto [lastLevel, lastLower] = tree_.info(last);
+        const unsigned prefixShift =
+            shift_ - lastLevel * log_num_bins_ + log_num_bins_;
+        const KeyType binLower = lower + (KeyType(bin) << width);
+        const size_t offset = table.size();
+        table.resize(offset + Header::Size);
+        Entry* header = &table[offset];
+        header[Header::Node] = static_cast<Entry>(order[last]);
+        header[Header::Below] = static_cast<Entry>(ranges[first].first);
+        header[Header::Above] = static_cast<Entry>(ranges[first].second);
+        header[Header::NumSkipped] = static_cast<Entry>(numSkipped);
+        Header::SetPrefix(header,
+                          static_cast<uint64_t>(lastLower - binLower) >>
+                              prefixShift);
+        table[index] = Traits::Chain | static_cast<Entry>(offset);
+      }
+    }
+    UpdatePeakBytes(table.capacity() * sizeof(Entry) +
+                    numNodes * (sizeof(Range) + 2 * sizeof(size_t)));
+    return table;
   }
 
   // Flatten the layout of the tree, such that the final layout is
   // cache-oblivious.
-  void CacheObliviousFlatten() {
+  template <class Entry>
+  TableVector<Entry> CacheObliviousFlatten() {
+    // The permutation is computed on 32-bit node indices.
+    constexpr unsigned Infinity = std::numeric_limits<unsigned>::max();
+    assert(tree_.size() < Infinity);
+
     // Build the precendence graph between nodes.
     assert(!tree_.empty());
-    auto maxLevel = tree_.back().first.first;
+    auto maxLevel = tree_.info(tree_.size() - 1).first;
     std::vector<std::vector<unsigned>> graph(tree_.size());
     for (unsigned index = 0, limit = tree_.size(); index != limit; ++index) {
       graph[index].reserve(num_bins_);
       for (unsigned bin = 0; bin != num_bins_; ++bin) {
         // No leaf?
-        if ((tree_[index].second[bin].first & Leaf) == 0) {
-          graph[index].push_back(tree_[index].second[bin].second);
+        if ((tree_.bins(index)[bin].first & Leaf) == 0) {
+          graph[index].push_back(tree_.bins(index)[bin].second);
         }
       }
     }
@@ -351,7 +874,7 @@ class Builder {
     std::vector<std::pair<unsigned, unsigned>> helper(static_cast<size_t>(tree_.size()) * (maxLevel + 1), {Infinity, 0});
     for (unsigned index = 0, limit = tree_.size(); index != limit; ++index) {
       auto vertex = limit - index - 1;
-      const auto currLvl = tree_[vertex].first.first;
+      const auto currLvl = tree_.info(vertex).first;
 
       // Add the vertex itself.
       helper[access(vertex) + currLvl] = {vertex, 1};
@@ -412,23 +935,18 @@ class Builder {
     fill(0, 0, maxLevel + 1);
 
     // Flatten with `order`.
-    table_.resize(static_cast<size_t>(tree_.size()) * num_bins_);
+    auto table = NewTable<Entry>(tree_.size() * num_bins_);
+    UpdatePeakBytes(table.size() * sizeof(Entry) +
+                    helper.size() * sizeof(helper[0]) +
+                    order.size() * sizeof(unsigned));
+    const auto permute = [&](size_t index) { return order[index]; };
     for (unsigned index = 0, limit = tree_.size(); index != limit; ++index) {
       for (unsigned bin = 0; bin != num_bins_; ++bin) {
-        // Leaf node?
-        if (tree_[index].second[bin].first & Leaf) {
-          // Set the partial sum.
-          table_[(static_cast<size_t>(order[index]) << log_num_bins_) + bin] = tree_[index].second[bin].first;
-        } else {
-          // Set the pointer.
-          table_[(static_cast<size_t>(order[index]) << log_num_bins_) + bin] = order[tree_[index].second[bin].second];
-        }
+        table[(static_cast<size_t>(order[index]) << log_num_bins_) + bin] =
+            ToEntry<Entry>(tree_.bins(index)[bin], permute);
       }
     }
-
-    // And clean.
-    helper.clear();
-    order.clear();
+    return table;
   }
 
   const KeyType min_key_;
@@ -438,14 +956,29 @@ class Builder {
   const size_t max_error_;
   const bool single_pass_;
   const bool use_cache_;
+  const size_t num_threads_;
 
   size_t curr_num_keys_;
   KeyType prev_key_;
   size_t shift_;
-
+  bool force_wide_entries_ = false;
+  bool huge_pages_ = true;
+  // The log of the maximum fanout of `UseAdaptiveFanout`, or 0.
+  unsigned max_log_num_bins_ = 0;
+  bool path_compression_ = false;
+  bool tight_bounds_ = false;
+  bool interpolation_ = false;
+  // The number of nodes of the root, and their level, see `UseRootFanout`.
+  size_t num_root_nodes_ = 1;
+  unsigned root_level_ = 0;
+  size_t peak_bytes_ = 0;
+
+  // The keys added by `AddKey`, which the offline build reads through
+  // `Key`, unless `Build` points it at the caller's keys.
   std::vector<KeyType> keys_;
-  std::vector<unsigned> table_;
-  std::vector<std::pair<Info, std::vector<Range>>> tree_;
+  const char* key_data_ = nullptr;
+  size_t key_stride_ = sizeof(KeyType);
+  Tree tree_;
 };
 
 }  // namespace cht
@@ -1,15 +1,54 @@
 #pragma once
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 #include <algorithm>
 #include <cassert>
+#include <cstring>
+#include <fstream>
 #include <optional>
 #include <queue>
+#include <stdexcept>
+#include <string>
 #include <vector>
 
 #include "common.h"
+#include "instrumentation.h"
+#include "search.h"
+#include "simd.h"
+#include "table.h"
 
 namespace cht {
 
+template <class KeyType, size_t NumBins>
+class StaticCompactHistTree;
+
+template <class KeyType>
+class Builder;
+
+// The shape of a `CompactHistTree`, see `CompactHistTree::Stats`. The levels
+// count the table accesses of a lookup from the root, which is at level 0.
+struct TreeStats {
+  // The number of nodes and their bytes, per level. In the compressed layout,
+  // a chain header counts as a node of the level at which it is read.
+  std::vector<size_t> nodes_per_level;
+  std::vector<size_t> bytes_per_level;
+  // The number of leaf entries, including those of empty bins.
+  size_t num_leaves = 0;
+  // The number of table accesses of a lookup, at most and on average over
+  // the keys.
+  size_t max_depth = 0;
+  double avg_depth = 0;
+  // `keys_per_leaf[i]` is the number of leaves with `i` keys, for `i` up to
+  // `max_error`, and the last one counts the leaves with more keys. These
+  // are bins of duplicates which cannot be split any further.
+  std::vector<size_t> keys_per_leaf;
+  size_t num_oversized_leaves = 0;
+};
+
 template <class KeyType>
 class CompactHistTree {
  public:
@@ -17,7 +56,8 @@ class CompactHistTree {
 
   CompactHistTree(KeyType min_key, KeyType max_key, size_t num_keys,
                   size_t num_bins, size_t log_num_bins, size_t max_error,
-                  size_t shift, std::vector<unsigned> table)
+                  size_t shift, Table<unsigned> table,
+                  Layout layout = Layout::Uniform, bool tight_bounds = false)
       : min_key_(min_key),
         max_key_(max_key),
         num_keys_(num_keys),
@@ -25,11 +65,416 @@ class CompactHistTree {
         log_num_bins_(log_num_bins),
         max_error_(max_error),
         shift_(shift),
+        layout_(layout),
+        tight_bounds_(tight_bounds),
         table_(std::move(table)) {}
-        
+
+  // Same, but with 64-bit table entries, which are needed beyond 2^31 keys or
+  // nodes.
+  CompactHistTree(KeyType min_key, KeyType max_key, size_t num_keys,
+                  size_t num_bins, size_t log_num_bins, size_t max_error,
+                  size_t shift, Table<uint64_t> table,
+                  Layout layout = Layout::Uniform, bool tight_bounds = false)
+      : min_key_(min_key),
+        max_key_(max_key),
+        num_keys_(num_keys),
+        num_bins_(num_bins),
+        log_num_bins_(log_num_bins),
+        max_error_(max_error),
+        shift_(shift),
+        layout_(layout),
+        tight_bounds_(tight_bounds),
+        wide_(true),
+        wide_table_(std::move(table)) {}
+
+  // Writes the tree to `path`, in a format which can be memory-mapped with
+  // `Map`. The file stores the keys and the table in the byte order of the
+  // host.
+  void Serialize(const std::string& path) const {
+    FileHeader header;
+    std::memcpy(header.magic, kMagic, sizeof(kMagic));
+    header.version = kVersion;
+    header.key_size = sizeof(KeyType);
+    header.min_key = min_key_;
+    header.max_key = max_key_;
+    header.num_keys = num_keys_;
+    header.num_bins = num_bins_;
+    header.log_num_bins = log_num_bins_;
+    header.max_error = max_error_;
+    header.shift = shift_;
+    header.table_size = wide_ ? wide_table_.size() : table_.size();
+    header.entry_size = wide_ ? sizeof(uint64_t) : sizeof(unsigned);
+    header.layout = static_cast<uint64_t>(layout_);
+    header.tight_bounds = tight_bounds_;
+    header.num_node_errors = node_errors_.size();
+
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    if (!out.is_open())
+      throw std::runtime_error("unable to open " + path);
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    // The table starts on the next page.
+    const std::vector<char> padding(kTableOffset - sizeof(header), 0);
+    out.write(padding.data(), padding.size());
+    if (wide_) {
+      out.write(reinterpret_cast<const char*>(wide_table_.data()),
+                wide_table_.size() * sizeof(uint64_t));
+    } else {
+      out.write(reinterpret_cast<const char*>(table_.data()),
+                table_.size() * sizeof(unsigned));
+    }
+    // The errors of the interpolated leaves follow the table.
+    out.write(reinterpret_cast<const char*>(node_errors_.data()),
+              node_errors_.size() * sizeof(uint16_t));
+    if (!out.good()) throw std::runtime_error("unable to write " + path);
+  }
+
+  // Memory-maps a tree written by `Serialize`. The table is used directly
+  // from the page cache, so processes which map the same file share it.
+  static CompactHistTree Map(const std::string& path) {
+    const int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd == -1) throw std::runtime_error("unable to open " + path);
+    struct stat st;
+    if (::fstat(fd, &st) == -1 ||
+        static_cast<size_t>(st.st_size) < kTableOffset) {
+      ::close(fd);
+      throw std::runtime_error(path + " is not a CompactHistTree file");
+    }
+    const size_t fileSize = st.st_size;
+    void* addr = ::mmap(nullptr, fileSize, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (addr == MAP_FAILED) throw std::runtime_error("unable to map " + path);
+    std::shared_ptr<const void> memory(
+        addr, [fileSize](const void* ptr) {
+          ::munmap(const_cast<void*>(ptr), fileSize);
+        });
+
+    // Check the header.
+    FileHeader header;
+    std::memcpy(&header, addr, sizeof(header));
+    if (std::memcmp(header.magic, kMagic, sizeof(kMagic)) != 0 ||
+        header.version < 1 || header.version > kVersion)
+      throw std::runtime_error(path + " is not a CompactHistTree file");
+    if (header.key_size != sizeof(KeyType))
+      throw std::runtime_error(path + " was written for another key type");
+    // Version 1 only had 32-bit entries and left the field zeroed.
+    if (header.entry_size == 0) header.entry_size = sizeof(unsigned);
+    if (header.entry_size != sizeof(unsigned) &&
+        header.entry_size != sizeof(uint64_t))
+      throw std::runtime_error(path + " is not a CompactHistTree file");
+    // Before version 3, all trees had the uniform layout, and the field was
+    // part of the zeroed padding.
+    if (header.layout > static_cast<uint64_t>(Layout::Compressed))
+      throw std::runtime_error(path + " is not a CompactHistTree file");
+    const auto layout = static_cast<Layout>(header.layout);
+    const size_t tableBytes = header.table_size * header.entry_size;
+    if (fileSize < kTableOffset + tableBytes +
+                       header.num_node_errors * sizeof(uint16_t))
+      throw std::runtime_error(path + " is truncated");
+
+    const auto* table = static_cast<const char*>(addr) + kTableOffset;
+    Table<uint16_t> nodeErrors(
+        memory, reinterpret_cast<const uint16_t*>(table + tableBytes),
+        header.num_node_errors);
+    CompactHistTree cht;
+    if (header.entry_size == sizeof(uint64_t)) {
+      cht = CompactHistTree(
+          header.min_key, header.max_key, header.num_keys, header.num_bins,
+          header.log_num_bins, header.max_error, header.shift,
+          Table<uint64_t>(std::move(memory),
+                          reinterpret_cast<const uint64_t*>(table),
+                          header.table_size),
+          layout, header.tight_bounds);
+    } else {
+      cht = CompactHistTree(
+          header.min_key, header.max_key, header.num_keys, header.num_bins,
+          header.log_num_bins, header.max_error, header.shift,
+          Table<unsigned>(std::move(memory),
+                          reinterpret_cast<const unsigned*>(table),
+                          header.table_size),
+          layout, header.tight_bounds);
+    }
+    cht.node_errors_ = std::move(nodeErrors);
+    return cht;
+  }
+
   // Returns a search bound [`begin`, `end`) around the estimated position.
   SearchBound GetSearchBound(const KeyType key) const {
-    const size_t begin = Lookup(key);
+    return Lookup(key);
+  }
+
+  // Same, and reports the lookup to `policy`, e.g. a `LookupCounters`.
+  template <class Policy>
+  SearchBound GetSearchBound(const KeyType key, Policy& policy) const {
+    policy.BeginLookup();
+    const auto bound = Lookup(key, policy);
+    policy.EndLookup(bound.end - bound.begin);
+    return bound;
+  }
+
+  // Computes the search bounds of `num_keys` keys at once, i.e. `out[i]` is
+  // the search bound of `keys[i]`. The lookups are walked through the tree
+  // level by level in lock-step, such that their cache misses overlap.
+  void GetSearchBounds(const KeyType* keys, size_t num_keys,
+                       SearchBound* out) const {
+    size_t offset = 0;
+    if (UseVectorLookup()) {
+      const simd::LookupArgs<KeyType> args{
+          table_.data(),
+          min_key_,
+          max_key_,
+          static_cast<unsigned>(shift_),
+          static_cast<unsigned>(log_num_bins_),
+          num_keys_ - 1};
+      size_t pos[simd::kBlockSize];
+      for (; offset + simd::kBlockSize <= num_keys;
+           offset += simd::kBlockSize) {
+        simd::Lookup(args, keys + offset, pos);
+        for (unsigned index = 0; index != simd::kBlockSize; ++index)
+          out[offset + index] = ToSearchBound(pos[index]);
+      }
+    }
+    for (; offset < num_keys; offset += kBatchSize) {
+      const auto size = std::min(kBatchSize, num_keys - offset);
+      if (layout_ == Layout::Adaptive) {
+        if (wide_) {
+          BatchLookup<Layout::Adaptive>(wide_table_, keys + offset, size,
+                                        out + offset);
+        } else {
+          BatchLookup<Layout::Adaptive>(table_, keys + offset, size,
+                                        out + offset);
+        }
+      } else if (layout_ == Layout::Compressed) {
+        if (wide_) {
+          BatchLookup<Layout::Compressed>(wide_table_, keys + offset, size,
+                                          out + offset);
+        } else {
+          BatchLookup<Layout::Compressed>(table_, keys + offset, size,
+                                          out + offset);
+        }
+      } else if (wide_) {
+        BatchLookup<Layout::Uniform>(wide_table_, keys + offset, size,
+                                     out + offset);
+      } else {
+        BatchLookup<Layout::Uniform>(table_, keys + offset, size,
+                                     out + offset);
+      }
+    }
+  }
+
+  // Returns the position of the first key in `data` which is not less than
+  // `key`, where `data` holds the sorted keys the tree was built on.
+  size_t LowerBound(const KeyType* data, KeyType key) const {
+    return FindLowerBound(search::DenseKeys<KeyType>{data}, key);
+  }
+
+  // Same, and reports the lookup to `policy`.
+  template <class Policy>
+  size_t LowerBound(const KeyType* data, KeyType key, Policy& policy) const {
+    const auto bound = GetSearchBound(key, policy);
+    return search::LowerBound(search::DenseKeys<KeyType>{data}, bound.begin,
+                              bound.end, key);
+  }
+
+  // Same, for keys stored in the member `key_member` of the sorted `rows`.
+  template <class Row>
+  size_t LowerBound(const Row* rows, KeyType Row::*key_member,
+                    KeyType key) const {
+    return FindLowerBound(search::RowKeys<Row, KeyType>{rows, key_member}, key);
+  }
+
+  // Computes the lower bounds of `num_keys` keys at once, i.e. `out[i]` is
+  // `LowerBound(data, keys[i])`. Both the lookups and the searches of their
+  // bounds are run in lock-step, such that their cache misses overlap.
+  void LowerBounds(const KeyType* data, const KeyType* keys, size_t num_keys,
+                   size_t* out) const {
+    FindLowerBounds(search::DenseKeys<KeyType>{data}, keys, num_keys, out);
+  }
+
+  // Same, for keys stored in the member `key_member` of the sorted `rows`.
+  template <class Row>
+  void LowerBounds(const Row* rows, KeyType Row::*key_member,
+                   const KeyType* keys, size_t num_keys, size_t* out) const {
+    FindLowerBounds(search::RowKeys<Row, KeyType>{rows, key_member}, keys,
+                    num_keys, out);
+  }
+
+  // Returns the size in bytes.
+  size_t GetSize() const {
+    return sizeof(*this) + table_.size() * sizeof(unsigned) +
+           wide_table_.size() * sizeof(uint64_t) +
+           node_errors_.size() * sizeof(uint16_t);
+  }
+
+  // Returns the size in bytes as allocated, i.e. with the table rounded up to
+  // its alignment, which is a huge page for large tables.
+  size_t GetAllocatedSize() const {
+    return sizeof(*this) + table_.allocated_bytes() +
+           wide_table_.allocated_bytes() + node_errors_.allocated_bytes();
+  }
+
+  // Returns the shape of the tree, by walking all its nodes.
+  TreeStats Stats() const {
+    return wide_ ? CollectStats(wide_table_) : CollectStats(table_);
+  }
+
+  // Returns the number of bins per node, or of the root in the adaptive
+  // layout.
+  size_t GetNumBins() const { return num_bins_; }
+
+  // Returns how the nodes are laid out in the table.
+  Layout GetLayout() const { return layout_; }
+
+  // Whether the table has 64-bit entries.
+  bool HasWideEntries() const { return wide_; }
+
+  // Whether the search bounds end at the next bin, see
+  // `Builder::UseTightBounds`.
+  bool HasTightBounds() const { return tight_bounds_; }
+
+  // Whether the positions are interpolated within the leaves, see
+  // `Builder::UseInterpolation`.
+  bool IsInterpolated() const { return node_errors_.size() != 0; }
+
+ private:
+  template <class, size_t>
+  friend class StaticCompactHistTree;
+  template <class>
+  friend class Builder;
+
+  static constexpr unsigned Leaf = EntryTraits<unsigned>::Leaf;
+  static constexpr unsigned Mask = EntryTraits<unsigned>::Mask;
+
+  // The error of a node whose leaves are not interpolated.
+  static constexpr uint16_t kNoInterpolation = 0xFFFF;
+
+  // On-disk format of `Serialize`.
+  static constexpr char kMagic[8] = {'C', 'H', 'T', 'R', 'E', 'E', 0, 0};
+  static constexpr uint32_t kVersion = 5;
+  // The table is page-aligned.
+  static constexpr size_t kTableOffset = 4096;
+
+  struct FileHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t key_size;
+    uint64_t min_key;
+    uint64_t max_key;
+    uint64_t num_keys;
+    uint64_t num_bins;
+    uint64_t log_num_bins;
+    uint64_t max_error;
+    uint64_t shift;
+    uint64_t table_size;
+    // Since version 2.
+    uint64_t entry_size;
+    // Since version 3.
+    uint64_t layout;
+    // Since version 4.
+    uint64_t tight_bounds;
+    // Since version 5.
+    uint64_t num_node_errors;
+  };
+
+  // Walks the nodes in key order, such that the keys of a leaf end at the
+  // partial sum of the next one.
+  template <class Entry>
+  TreeStats CollectStats(const Table<Entry>& table) const {
+    using Traits = EntryTraits<Entry>;
+    using Header = ChainHeader<Entry>;
+    TreeStats stats;
+    stats.keys_per_leaf.resize(max_error_ + 2, 0);
+    if (!table.size()) return stats;
+
+    // A node at `offset` with `size` entries, and the next of them.
+    struct Frame {
+      size_t offset;
+      size_t size;
+      size_t bin;
+      size_t level;
+    };
+    const auto addNode = [&](size_t level, size_t size) {
+      if (level >= stats.nodes_per_level.size()) {
+        stats.nodes_per_level.resize(level + 1, 0);
+        stats.bytes_per_level.resize(level + 1, 0);
+      }
+      ++stats.nodes_per_level[level];
+      stats.bytes_per_level[level] += size * sizeof(Entry);
+    };
+
+    // In the uniform layouts, the root may have more bins than the other
+    // nodes, as many as cover the range at its width.
+    size_t rootSize = size_t(1) << log_num_bins_;
+    if (layout_ != Layout::Adaptive) {
+      const uint64_t lastBin = static_cast<uint64_t>(max_key_ - min_key_) >>
+                               shift_;
+      while (rootSize <= lastBin) rootSize <<= 1;
+    }
+    std::vector<Frame> stack = {{0, rootSize, 0, 0}};
+    addNode(0, rootSize);
+
+    // The leaf whose keys are not yet counted, and its depth.
+    std::optional<std::pair<size_t, size_t>> pending;
+    double sumDepth = 0;
+    const auto addLeaf = [&](size_t begin, size_t depth) {
+      ++stats.num_leaves;
+      stats.max_depth = std::max(stats.max_depth, depth);
+      if (pending) {
+        const size_t numKeys = begin - pending->first;
+        ++stats.keys_per_leaf[std::min(numKeys, max_error_ + 1)];
+        stats.num_oversized_leaves += numKeys > max_error_;
+        sumDepth += static_cast<double>(numKeys) * pending->second;
+      }
+      pending = {begin, depth};
+    };
+
+    while (!stack.empty()) {
+      auto& frame = stack.back();
+      if (frame.bin == frame.size) {
+        stack.pop_back();
+        continue;
+      }
+      const size_t level = frame.level;
+      Entry next = table[frame.offset + frame.bin++];
+      if (next & Traits::Leaf) {
+        addLeaf(next & Traits::Mask, level + 1);
+        continue;
+      }
+
+      if (layout_ == Layout::Adaptive) {
+        const size_t size = size_t(1) << (next >> Traits::FanoutShift);
+        addNode(level + 1, size);
+        stack.push_back({next & Traits::OffsetMask, size, 0, level + 1});
+        continue;
+      }
+      size_t childLevel = level + 1;
+      if (layout_ == Layout::Compressed && (next & Traits::Chain)) {
+        addNode(childLevel++, Header::Size);
+        next = table[(next & Traits::ChainMask) + Header::Node];
+      }
+      addNode(childLevel, num_bins_);
+      stack.push_back({static_cast<size_t>(next) << log_num_bins_, num_bins_,
+                       0, childLevel});
+    }
+    addLeaf(num_keys_, 0);
+    --stats.num_leaves;
+    stats.avg_depth = num_keys_ ? sumDepth / num_keys_ : 0;
+    return stats;
+  }
+
+  // Number of lookups in flight in `BatchLookup`.
+  static constexpr size_t kBatchSize = 16;
+
+  // Whether `GetSearchBounds` can use the vectorized kernels, which need the
+  // uniform layout, runtime support of the CPU and a table addressable with
+  // 32-bit offsets.
+  bool UseVectorLookup() const {
+    return layout_ == Layout::Uniform && !wide_ && !tight_bounds_ &&
+           simd::HasKernel<KeyType>() &&
+           table_.size() <= static_cast<size_t>(Mask) + 1;
+  }
+
+  // Extends the estimated position `begin` to a search bound.
+  SearchBound ToSearchBound(size_t begin) const {
     // `end` is exclusive.
     const size_t end = (begin + max_error_ + 1 > num_keys_)
                            ? num_keys_
@@ -37,38 +482,400 @@ class CompactHistTree {
     return SearchBound{begin, end};
   }
 
-  // Returns the size in bytes.
-  size_t GetSize() const {
-    return sizeof(*this) + table_.size() * sizeof(unsigned);
+  // Same, for the leaf whose next bin in the same node has the entry `next`,
+  // or which is the last bin of its node if `next` is null. With tight
+  // bounds, the bound ends where the keys of the next bin start, if it is a
+  // leaf.
+  template <class Entry>
+  SearchBound ToSearchBound(size_t begin, const Entry* next) const {
+    using Traits = EntryTraits<Entry>;
+    auto bound = ToSearchBound(begin);
+    if (tight_bounds_ && next && (*next & Traits::Leaf))
+      bound.end = std::min<size_t>(bound.end, *next & Traits::Mask);
+    return bound;
   }
 
- private:
-  static constexpr unsigned Leaf = (1u << 31);
-  static constexpr unsigned Mask = Leaf - 1;
+  // Returns the search bound of a key whose lower bound is known to be `pos`,
+  // i.e. an empty one with tight bounds.
+  SearchBound ToExactSearchBound(size_t pos) const {
+    return tight_bounds_ ? SearchBound{pos, pos} : ToSearchBound(pos);
+  }
+
+  // Returns the entry of the bin after the one at `index` in the uniform
+  // layouts, or null if it is the last bin of its node.
+  template <class Entry>
+  const Entry* NextBin(const Table<Entry>& table, size_t index) const {
+    return ((index + 1) & (num_bins_ - 1)) ? &table[index + 1] : nullptr;
+  }
+
+  // Interpolates the position of the key at `offset` within a bin of
+  // `2^width` keys, whose keys are at [`begin`, `end`). The offset is reduced
+  // to a 16-bit fraction of the bin, such that the product fits into 64 bits.
+  static size_t EstimatePosition(size_t begin, size_t end, uint64_t offset,
+                                 size_t width) {
+    const uint64_t fraction =
+        width > 16 ? offset >> (width - 16) : offset << (16 - width);
+    return begin + ((fraction * (end - begin)) >> 16);
+  }
+
+  // Returns the search bound of the key at `offset` within the bin of
+  // `2^width` keys at `index`, whose keys start at `begin`. The bound spans
+  // the error of the node around the interpolated position. If the end of
+  // the bin is not known, the bin is oversized, or the node is not
+  // interpolated, it is the tight bound.
+  template <class Entry>
+  SearchBound Interpolate(const Table<Entry>& table, size_t index,
+                          size_t begin, uint64_t offset, size_t width) const {
+    using Traits = EntryTraits<Entry>;
+    const Entry* next = NextBin(table, index);
+    if (!next || !(*next & Traits::Leaf)) return ToSearchBound(begin, next);
+    const size_t end = *next & Traits::Mask;
+    const size_t error = node_errors_[index >> log_num_bins_];
+    if (end - begin > max_error_ || error == kNoInterpolation)
+      return ToSearchBound(begin, next);
+    const size_t pos = EstimatePosition(begin, end, offset, width);
+    return SearchBound{pos > begin + error ? pos - error : begin,
+                       std::min(end, pos + error + 1)};
+  }
+
+  template <class KeyAt>
+  void InterpolateLeaves(const KeyAt& key_at) {
+    if (wide_) {
+      InterpolateLeaves(wide_table_, key_at);
+    } else {
+      InterpolateLeaves(table_, key_at);
+    }
+  }
+
+  // Computes the errors of the interpolation per node, from the keys the
+  // tree was built on, where `key_at(i)` is the key at position `i`. The
+  // bound of a key has to cover its first position, and, for the keys
+  // between it and the next one, also its last one. The oversized bins,
+  // i.e. the runs of more than `max_error` duplicates, keep the tight bound
+  // and are left out, so they do not widen the bounds of the other bins of
+  // their node. Shorter runs still count towards the error of their node.
+  // The bins are walked as in `CollectStats`, in the uniform layouts.
+  template <class Entry, class KeyAt>
+  void InterpolateLeaves(const Table<Entry>& table, const KeyAt& key_at) {
+    using Traits = EntryTraits<Entry>;
+    TableVector<uint16_t> errors(table.size() >> log_num_bins_, 0);
+
+    // A node at `offset` with `size` bins of `2^width` keys from `lower`.
+    struct Frame {
+      size_t offset;
+      size_t size;
+      size_t width;
+      uint64_t lower;
+    };
+    size_t rootSize = size_t(1) << log_num_bins_;
+    const uint64_t lastBin = static_cast<uint64_t>(max_key_ - min_key_) >>
+                             shift_;
+    while (rootSize <= lastBin) rootSize <<= 1;
+    std::vector<Frame> stack = {{0, rootSize, shift_, 0}};
+    while (!stack.empty()) {
+      const auto frame = stack.back();
+      stack.pop_back();
+      for (size_t bin = 0; bin != frame.size; ++bin) {
+        const size_t index = frame.offset + bin;
+        const Entry entry = table[index];
+        const uint64_t lower = frame.lower + (uint64_t(bin) << frame.width);
+        if (!(entry & Traits::Leaf)) {
+          stack.push_back({static_cast<size_t>(entry) << log_num_bins_,
+                           num_bins_, frame.width - log_num_bins_, lower});
+          continue;
+        }
+        const Entry* next = NextBin(table, index);
+        if (!next || !(*next & Traits::Leaf)) continue;
+
+        const size_t begin = entry & Traits::Mask, end = *next & Traits::Mask;
+        if (end - begin > max_error_) continue;
+        size_t error = 0;
+        for (size_t first = begin, last; first < end; first = last + 1) {
+          const KeyType key = key_at(first);
+          for (last = first; last + 1 < end && key_at(last + 1) == key;)
+            ++last;
+          const size_t pos = EstimatePosition(
+              begin, end, static_cast<uint64_t>(key - min_key_) - lower,
+              frame.width);
+          error = std::max({error, pos > first ? pos - first : 0,
+                            last > pos ? last - pos : 0});
+        }
+        auto& nodeError = errors[index >> log_num_bins_];
+        nodeError = static_cast<uint16_t>(std::min<size_t>(
+            std::max<size_t>(nodeError, error), kNoInterpolation));
+      }
+    }
+    node_errors_ = Table<uint16_t>(std::move(errors));
+  }
+
+  template <class Keys>
+  size_t FindLowerBound(const Keys& data, KeyType key) const {
+    const auto bound = GetSearchBound(key);
+    return search::LowerBound(data, bound.begin, bound.end, key);
+  }
+
+  template <class Keys>
+  void FindLowerBounds(const Keys& data, const KeyType* keys,
+                       size_t num_keys, size_t* out) const {
+    static_assert(kBatchSize <= search::kMaxBatchSize);
+    SearchBound bounds[kBatchSize];
+    for (size_t offset = 0; offset < num_keys; offset += kBatchSize) {
+      const auto size = std::min(kBatchSize, num_keys - offset);
+      GetSearchBounds(keys + offset, size, bounds);
+      search::LowerBounds(data, bounds, keys + offset, size, out + offset);
+    }
+  }
 
   // Lookup `key` in tree
-  size_t Lookup(KeyType key) const {
+  SearchBound Lookup(KeyType key) const {
+    NoInstrumentation none;
+    return Lookup(key, none);
+  }
+
+  template <class Policy>
+  SearchBound Lookup(KeyType key, Policy& policy) const {
+    if (layout_ == Layout::Adaptive)
+      return wide_ ? AdaptiveLookup(wide_table_, key, policy)
+                   : AdaptiveLookup(table_, key, policy);
+    if (layout_ == Layout::Compressed)
+      return wide_ ? CompressedLookup(wide_table_, key, policy)
+                   : CompressedLookup(table_, key, policy);
+    return wide_ ? Lookup(wide_table_, key, policy)
+                 : Lookup(table_, key, policy);
+  }
+
+  // `policy` is told about each table access.
+  template <class Entry, class Policy>
+  SearchBound Lookup(const Table<Entry>& table, KeyType key,
+                     Policy& policy) const {
+    constexpr Entry Leaf = EntryTraits<Entry>::Leaf;
+    constexpr Entry Mask = EntryTraits<Entry>::Mask;
+
     // Edge cases
-    if (key <= min_key_) return 0;
-    if (key >= max_key_) return num_keys_ - 1;
+    if (key <= min_key_) return ToSearchBound(0);
+    // The last key may be duplicated, so its own lookup walks the tree.
+    if (key > max_key_) return ToSearchBound(num_keys_ - 1);
     key -= min_key_;
 
     auto width = shift_;
-    size_t next = 0;
+    size_t next = 0, level = 0;
     do {
       // Get the bin
       KeyType bin = key >> width;
-      next = table_[(next << log_num_bins_) + bin];
+      const size_t index = (next << log_num_bins_) + bin;
+      next = table[index];
+      policy.VisitLevel(level++);
 
       // Is it a leaf?
-      if (next & Leaf) return next & Mask;
-      
+      if (next & Leaf) {
+        if (node_errors_.size()) {
+          return Interpolate(table, index, next & Mask, key - (bin << width),
+                             width);
+        }
+        return ToSearchBound(next & Mask, NextBin(table, index));
+      }
+
       // Prepare for the next level
       key -= bin << width;
       width -= log_num_bins_;
     } while (true);
   }
 
+  // Same, in the adaptive layout. The root has `2^log_num_bins_` bins of width
+  // `shift_`, and the pointers give the fanout of the next node. Since the
+  // nodes cover aligned ranges, the bin is masked out of the key.
+  template <class Entry, class Policy>
+  SearchBound AdaptiveLookup(const Table<Entry>& table, KeyType key,
+                             Policy& policy) const {
+    using Traits = EntryTraits<Entry>;
+
+    // Edge cases
+    if (key <= min_key_) return ToSearchBound(0);
+    // The last key may be duplicated, so its own lookup walks the tree.
+    if (key > max_key_) return ToSearchBound(num_keys_ - 1);
+    key -= min_key_;
+
+    size_t width = shift_, logFanout = log_num_bins_, offset = 0, level = 0;
+    do {
+      const size_t bin = (key >> width) & ((size_t(1) << logFanout) - 1);
+      const Entry next = table[offset + bin];
+      policy.VisitLevel(level++);
+
+      // Is it a leaf?
+      if (next & Traits::Leaf) {
+        const bool isLast = bin + 1 == (size_t(1) << logFanout);
+        return ToSearchBound(next & Traits::Mask,
+                             isLast ? nullptr : &table[offset + bin + 1]);
+      }
+
+      // Decode the header of the next node.
+      logFanout = next >> Traits::FanoutShift;
+      offset = next & Traits::OffsetMask;
+      width -= logFanout;
+    } while (true);
+  }
+
+  // Same, in the compressed layout. A chain header replaces the nodes of the
+  // skipped levels: if the key has their bins, the lookup continues at the
+  // end of the chain, otherwise it is left or right of all keys of the chain.
+  template <class Entry, class Policy>
+  SearchBound CompressedLookup(const Table<Entry>& table, KeyType key,
+                               Policy& policy) const {
+    using Traits = EntryTraits<Entry>;
+    using Header = ChainHeader<Entry>;
+
+    // Edge cases
+    if (key <= min_key_) return ToSearchBound(0);
+    // The last key may be duplicated, so its own lookup walks the tree.
+    if (key > max_key_) return ToSearchBound(num_keys_ - 1);
+    key -= min_key_;
+
+    auto width = shift_;
+    size_t next = 0, level = 0;
+    do {
+      // Get the bin
+      KeyType bin = key >> width;
+      const size_t index = (next << log_num_bins_) + bin;
+      next = table[index];
+      policy.VisitLevel(level++);
+
+      // Is it a leaf?
+      if (next & Traits::Leaf)
+        return ToSearchBound(next & Traits::Mask, NextBin(table, index));
+
+      // Prepare for the next level
+      key -= bin << width;
+      width -= log_num_bins_;
+
+      // Is it a chain? Then check the bins of the skipped levels.
+      if (next & Traits::Chain) {
+        const Entry* header = &table[next & Traits::ChainMask];
+        policy.VisitLevel(level++);
+        width -= header[Header::NumSkipped] * log_num_bins_;
+        const unsigned prefixShift = width + log_num_bins_;
+        const uint64_t prefix = key >> prefixShift;
+        const uint64_t expected = Header::GetPrefix(header);
+        if (prefix != expected) {
+          return ToExactSearchBound(
+              header[prefix < expected ? Header::Below : Header::Above]);
+        }
+        key -= static_cast<KeyType>(prefix) << prefixShift;
+        next = header[Header::Node];
+      }
+    } while (true);
+  }
+
+  // Lookup `size` <= `kBatchSize` keys in tree. Each step first prefetches
+  // the entry of the next level, which is then only read in the next round,
+  // once the other lookups have issued their own prefetches.
+  template <Layout L, class Entry>
+  void BatchLookup(const Table<Entry>& table, const KeyType* keys, size_t size,
+                   SearchBound* out) const {
+    using Traits = EntryTraits<Entry>;
+    constexpr Entry Leaf = Traits::Leaf;
+    constexpr Entry Mask = Traits::Mask;
+
+    KeyType curr[kBatchSize];
+    size_t width[kBatchSize], pos[kBatchSize];
+    // In the adaptive layout, the index of the last bin of the node at `pos`.
+    size_t last[kBatchSize];
+    unsigned active[kBatchSize];
+    // In the compressed layout, whether `pos` is a chain header.
+    bool chain[kBatchSize] = {};
+
+    // Handle the edge cases and prefetch the root entries.
+    unsigned numActive = 0;
+    for (unsigned index = 0; index != size; ++index) {
+      if (keys[index] <= min_key_) {
+        out[index] = ToSearchBound(0);
+      } else if (keys[index] > max_key_) {
+        out[index] = ToSearchBound(num_keys_ - 1);
+      } else {
+        curr[index] = keys[index] - min_key_;
+        width[index] = shift_;
+        pos[index] = curr[index] >> shift_;
+        last[index] = (size_t(1) << log_num_bins_) - 1;
+        __builtin_prefetch(&table[pos[index]]);
+        active[numActive++] = index;
+      }
+    }
+
+    // Advance all active lookups by one level per round.
+    while (numActive) {
+      for (unsigned iter = 0; iter != numActive;) {
+        const auto index = active[iter];
+        if constexpr (L == Layout::Compressed) {
+          if (chain[index]) {
+            using Header = ChainHeader<Entry>;
+            const Entry* header = &table[pos[index]];
+            width[index] -= header[Header::NumSkipped] * log_num_bins_;
+            const unsigned prefixShift = width[index] + log_num_bins_;
+            const uint64_t prefix = curr[index] >> prefixShift;
+            const uint64_t expected = Header::GetPrefix(header);
+            if (prefix != expected) {
+              out[index] = ToExactSearchBound(
+                  header[prefix < expected ? Header::Below : Header::Above]);
+              active[iter] = active[--numActive];
+              continue;
+            }
+            curr[index] -= static_cast<KeyType>(prefix) << prefixShift;
+            chain[index] = false;
+            pos[index] =
+                (static_cast<size_t>(header[Header::Node]) << log_num_bins_) +
+                (curr[index] >> width[index]);
+            __builtin_prefetch(&table[pos[index]]);
+            ++iter;
+            continue;
+          }
+        }
+        const auto next = table[pos[index]];
+
+        // Is it a leaf? Then retire the lookup.
+        if (next & Leaf) {
+          if constexpr (L == Layout::Adaptive) {
+            out[index] = ToSearchBound(
+                next & Mask,
+                pos[index] == last[index] ? nullptr : &table[pos[index] + 1]);
+          } else if (L == Layout::Uniform && node_errors_.size()) {
+            const KeyType bin = curr[index] >> width[index];
+            out[index] = Interpolate(table, pos[index], next & Mask,
+                                     curr[index] - (bin << width[index]),
+                                     width[index]);
+          } else {
+            out[index] =
+                ToSearchBound(next & Mask, NextBin(table, pos[index]));
+          }
+          active[iter] = active[--numActive];
+          continue;
+        }
+
+        // Prepare for the next level and prefetch its entry.
+        if constexpr (L == Layout::Adaptive) {
+          const size_t logFanout = next >> Traits::FanoutShift;
+          width[index] -= logFanout;
+          const size_t offset = next & Traits::OffsetMask;
+          pos[index] = offset + ((curr[index] >> width[index]) &
+                                 ((size_t(1) << logFanout) - 1));
+          last[index] = offset + (size_t(1) << logFanout) - 1;
+        } else {
+          KeyType bin = curr[index] >> width[index];
+          curr[index] -= bin << width[index];
+          width[index] -= log_num_bins_;
+          if (L == Layout::Compressed && (next & Traits::Chain)) {
+            // Read the chain header in the next round.
+            chain[index] = true;
+            pos[index] = next & Traits::ChainMask;
+          } else {
+            pos[index] = (static_cast<size_t>(next) << log_num_bins_) +
+                         (curr[index] >> width[index]);
+          }
+        }
+        __builtin_prefetch(&table[pos[index]]);
+        ++iter;
+      }
+    }
+  }
+
   KeyType min_key_;
   KeyType max_key_;
   size_t num_keys_;
@@ -76,8 +883,15 @@ class CompactHistTree {
   size_t log_num_bins_;
   size_t max_error_;
   size_t shift_;
+  Layout layout_ = Layout::Uniform;
+  bool tight_bounds_ = false;
+  bool wide_ = false;
 
-  std::vector<unsigned> table_;
+  // Only one of the tables is used, depending on `wide_`.
+  Table<unsigned> table_;
+  Table<uint64_t> wide_table_;
+  // The errors of the interpolated leaves per node, or empty.
+  Table<uint16_t> node_errors_;
 };
 
 }  // namespace cht
@@ -2,6 +2,7 @@
 
 #include <cstddef>
 #include <cstdint>
+#include <cstring>
 
 namespace cht {
 
@@ -10,4 +11,62 @@ struct SearchBound {
   size_t end;  // Exclusive.
 };
 
+// A table entry either points to the next node or, if `Leaf` is set, holds
+// the partial sum of its bin in the remaining bits.
+template <class Entry>
+struct EntryTraits {
+  static constexpr Entry Leaf = Entry(1) << (8 * sizeof(Entry) - 1);
+  static constexpr Entry Mask = Leaf - 1;
+
+  // In the `Adaptive` layout, a pointer also holds the header of its node:
+  // the log of the node's fanout is stored above `FanoutShift`, and the
+  // offset of the node's first entry below it.
+  static constexpr unsigned FanoutShift = 8 * sizeof(Entry) - 7;
+  static constexpr Entry OffsetMask = (Entry(1) << FanoutShift) - 1;
+
+  // In the `Compressed` layout, a pointer with `Chain` set holds the offset of
+  // a `ChainHeader` instead of a node.
+  static constexpr Entry Chain = Leaf >> 1;
+  static constexpr Entry ChainMask = Chain - 1;
+};
+
+// A chain of nodes whose keys all fall into a single bin, collapsed into the
+// entries of a header: the node at the end of the chain, the positions of
+// the keys left and right of the chain, the number of skipped levels and
+// their bins (the prefix), as a 64-bit value.
+template <class Entry>
+struct ChainHeader {
+  enum : size_t {
+    Node,
+    Below,
+    Above,
+    NumSkipped,
+    Prefix,
+    Size = Prefix + sizeof(uint64_t) / sizeof(Entry)
+  };
+
+  static uint64_t GetPrefix(const Entry* header) {
+    uint64_t prefix;
+    std::memcpy(&prefix, header + Prefix, sizeof(prefix));
+    return prefix;
+  }
+
+  static void SetPrefix(Entry* header, uint64_t prefix) {
+    std::memcpy(header + Prefix, &prefix, sizeof(prefix));
+  }
+};
+
+// How the nodes of a tree are laid out in its table.
+enum class Layout : uint32_t {
+  // All nodes have `num_bins` bins, and node `i` starts at entry
+  // `i * num_bins`.
+  Uniform,
+  // Each node has its own fanout, which the pointers to it store next to the
+  // entry it starts at.
+  Adaptive,
+  // As `Uniform`, but chains of nodes with a single non-empty bin are
+  // collapsed into a `ChainHeader`, which is stored after the nodes.
+  Compressed,
+};
+
 }  // namespace cht
@@ -0,0 +1,124 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+namespace cht {
+
+// The policies of the instrumented lookups, e.g.
+// `CompactHistTree::GetSearchBound(key, policy)`, are called at the start of
+// a lookup, for each table access with its level (0 is the root), and at the
+// end with the size of the search bound.
+
+// Records nothing, which is what the lookups without a policy use. Since the
+// calls are empty, they compile to the uninstrumented lookup.
+struct NoInstrumentation {
+  void BeginLookup() {}
+  void VisitLevel(size_t) {}
+  void EndLookup(size_t) {}
+};
+
+// Counts the table accesses per level, the number of levels per lookup and
+// the sizes of the search bounds. If `sample_every` is set, one in that many
+// lookups is also timed in cycles, for its latency percentiles.
+class LookupCounters {
+ public:
+  explicit LookupCounters(size_t sample_every = 0)
+      : sample_every_(sample_every) {}
+
+  void BeginLookup() {
+    levels_ = 0;
+    if (sample_every_ && ++num_unsampled_ == sample_every_) {
+      num_unsampled_ = 0;
+      start_ = ReadCycles();
+      sampled_ = true;
+    }
+  }
+
+  void VisitLevel(size_t level) {
+    if (level >= accesses_per_level_.size())
+      accesses_per_level_.resize(level + 1, 0);
+    ++accesses_per_level_[level];
+    ++levels_;
+  }
+
+  void EndLookup(size_t window) {
+    if (sampled_) {
+      cycles_.push_back(ReadCycles() - start_);
+      sampled_ = false;
+    }
+    ++num_lookups_;
+    Increment(lookups_per_num_levels_, levels_);
+    // The windows are bucketed by `ceil(log2(window))`.
+    Increment(windows_per_log_size_,
+              window <= 1 ? 0 : 64 - __builtin_clzll(window - 1));
+  }
+
+  size_t GetNumLookups() const { return num_lookups_; }
+
+  // `[i]` is the number of table accesses at level `i`.
+  const std::vector<uint64_t>& GetAccessesPerLevel() const {
+    return accesses_per_level_;
+  }
+
+  // `[i]` is the number of lookups which accessed `i` levels. The lookups of
+  // keys outside of the range of the tree access none.
+  const std::vector<uint64_t>& GetLookupsPerNumLevels() const {
+    return lookups_per_num_levels_;
+  }
+
+  // `[i]` is the number of search bounds of at most `2^i` keys, and more
+  // than `2^(i-1)`.
+  const std::vector<uint64_t>& GetWindowsPerLogSize() const {
+    return windows_per_log_size_;
+  }
+
+  // Returns the `percentile` (in [0, 100]) of the cycles of the sampled
+  // lookups, or 0 without samples.
+  uint64_t GetCyclesPercentile(double percentile) const {
+    if (cycles_.empty()) return 0;
+    std::vector<uint64_t> sorted = cycles_;
+    const size_t rank = std::min(
+        sorted.size() - 1,
+        static_cast<size_t>(percentile / 100 * (sorted.size() - 1) + 0.5));
+    std::nth_element(sorted.begin(), sorted.begin() + rank, sorted.end());
+    return sorted[rank];
+  }
+
+  size_t GetNumSamples() const { return cycles_.size(); }
+
+ private:
+  static uint64_t ReadCycles() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return std::chrono::steady_clock::now().time_since_epoch().count();
+#endif
+  }
+
+  static void Increment(std::vector<uint64_t>& counts, size_t index) {
+    if (index >= counts.size()) counts.resize(index + 1, 0);
+    ++counts[index];
+  }
+
+  size_t sample_every_;
+  size_t num_unsampled_ = 0;
+  bool sampled_ = false;
+  uint64_t start_ = 0;
+  size_t levels_ = 0;
+
+  size_t num_lookups_ = 0;
+  std::vector<uint64_t> accesses_per_level_;
+  std::vector<uint64_t> lookups_per_num_levels_;
+  std::vector<uint64_t> windows_per_log_size_;
+  std::vector<uint64_t> cycles_;
+};
+
+}  // namespace cht
@@ -0,0 +1,135 @@
+#pragma once
+
+#include <cstddef>
+
+#include "common.h"
+#include "simd.h"
+
+namespace cht {
+namespace search {
+
+// Windows of at most this many bytes of keys are scanned linearly. They span
+// a handful of cache lines, which a scan streams through without the
+// dependent loads of a binary search.
+static constexpr size_t kLinearSearchBytes = 256;
+
+// Maximum number of searches in flight in `LowerBounds`.
+static constexpr size_t kMaxBatchSize = 16;
+
+// Sorted keys stored contiguously.
+template <class KeyType>
+struct DenseKeys {
+  const KeyType* data;
+
+  const KeyType& operator[](size_t index) const { return data[index]; }
+  const void* Address(size_t index) const { return data + index; }
+};
+
+// Sorted keys stored in the member `key` of sorted rows.
+template <class Row, class KeyType>
+struct RowKeys {
+  const Row* rows;
+  KeyType Row::*key;
+
+  const KeyType& operator[](size_t index) const { return rows[index].*key; }
+  const void* Address(size_t index) const { return rows + index; }
+};
+
+// Returns the first position in [`begin`, `end`) whose key is not less than
+// `key`, or `end`. The window is halved with a conditional move instead of a
+// branch, so the search never mispredicts. Since the next probe then is not
+// known speculatively, both candidates are prefetched.
+template <class Keys, class KeyType>
+size_t BinaryLowerBound(const Keys& keys, size_t begin, size_t end,
+                        KeyType key) {
+  size_t size = end - begin;
+  if (size == 0) return begin;
+  while (size > 1) {
+    const size_t half = size / 2;
+    __builtin_prefetch(keys.Address(begin + half / 2));
+    __builtin_prefetch(keys.Address(begin + half + half / 2));
+    begin = (keys[begin + half] < key) ? begin + half : begin;
+    size -= half;
+  }
+  return begin + (keys[begin] < key);
+}
+
+// Same, by counting the keys less than `key`.
+template <class Keys, class KeyType>
+size_t LinearLowerBound(const Keys& keys, size_t begin, size_t end,
+                        KeyType key) {
+  size_t count = 0;
+  for (size_t index = begin; index != end; ++index) count += keys[index] < key;
+  return begin + count;
+}
+
+template <class KeyType>
+size_t LinearLowerBound(const DenseKeys<KeyType>& keys, size_t begin,
+                        size_t end, KeyType key) {
+  return begin + simd::CountLess(keys.data + begin, end - begin, key);
+}
+
+// Returns the first position in [`begin`, `end`) whose key is not less than
+// `key`, or `end`, with the search best suited to the size of the window.
+template <class Keys, class KeyType>
+size_t LowerBound(const Keys& keys, size_t begin, size_t end, KeyType key) {
+  if ((end - begin) * sizeof(KeyType) <= kLinearSearchBytes)
+    return LinearLowerBound(keys, begin, end, key);
+  return BinaryLowerBound(keys, begin, end, key);
+}
+
+// Computes the lower bounds of `size` keys at once, i.e. `out[i]` is
+// `LowerBound(data, bounds[i].begin, bounds[i].end, keys[i])`. The binary
+// searches are advanced in lock-step, and each step first prefetches the next
+// probe, which is then only read in the next round.
+template <class Keys, class KeyType>
+void LowerBounds(const Keys& data, const SearchBound* bounds,
+                 const KeyType* keys, size_t size, size_t* out) {
+  // Prefetch the start of the scanned windows, and the first probe of the
+  // searched ones.
+  for (size_t index = 0; index != size; ++index) {
+    const auto& bound = bounds[index];
+    const size_t width = bound.end - bound.begin;
+    __builtin_prefetch(data.Address(
+        width * sizeof(KeyType) <= kLinearSearchBytes ? bound.begin
+                                                      : bound.begin + width / 2));
+  }
+
+  size_t begin[kMaxBatchSize], width[kMaxBatchSize];
+  unsigned active[kMaxBatchSize];
+  unsigned numActive = 0;
+  for (unsigned index = 0; index != size; ++index) {
+    const auto& bound = bounds[index];
+    if ((bound.end - bound.begin) * sizeof(KeyType) <= kLinearSearchBytes) {
+      out[index] = LinearLowerBound(data, bound.begin, bound.end, keys[index]);
+    } else {
+      begin[index] = bound.begin;
+      width[index] = bound.end - bound.begin;
+      active[numActive++] = index;
+    }
+  }
+
+  // Halve all active windows once per round.
+  while (numActive) {
+    for (unsigned iter = 0; iter != numActive;) {
+      const auto index = active[iter];
+      const size_t half = width[index] / 2;
+      begin[index] = (data[begin[index] + half] < keys[index])
+                         ? begin[index] + half
+                         : begin[index];
+      width[index] -= half;
+
+      // Is the window down to a single key? Then retire the search.
+      if (width[index] == 1) {
+        out[index] = begin[index] + (data[begin[index]] < keys[index]);
+        active[iter] = active[--numActive];
+        continue;
+      }
+      __builtin_prefetch(data.Address(begin[index] + width[index] / 2));
+      ++iter;
+    }
+  }
+}
+
+}  // namespace search
+}  // namespace cht
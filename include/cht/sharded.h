@@ -0,0 +1,217 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "builder.h"
+#include "cht.h"
+#include "common.h"
+
+namespace cht {
+
+// Splits the sorted keys into up to `num_shards` ranges of about the same
+// number of keys, each indexed by its own `CompactHistTree` over its local
+// positions. A lookup first finds the shard in the sorted array of the
+// smallest keys of the shards, and then offsets the position in the shard by
+// the shard's first position. Since the positions are local, each table only
+// needs the narrow entries up to 2^31 keys per shard, and the shards can be
+// built, replaced and serialized independently.
+template <class KeyType>
+class ShardedHistTree {
+ public:
+  ShardedHistTree() = default;
+
+  // Builds the shards over the `num_keys` sorted `keys` on `num_threads`
+  // threads. The keys of a shard must span a range of at least `num_bins`
+  // values, so shards are merged with their successor where they would not,
+  // and duplicates of a key never straddle two shards.
+  ShardedHistTree(const KeyType* keys, size_t num_keys, size_t num_shards,
+                  size_t num_bins, size_t max_error, size_t num_threads = 1)
+      : num_keys_(num_keys) {
+    assert(num_keys && num_shards);
+    Partition(keys, num_keys, num_shards, num_bins);
+    shards_.resize(min_keys_.size());
+
+    std::atomic<size_t> next(0);
+    const auto work = [&]() -> void {
+      for (size_t shard; (shard = next.fetch_add(1)) < shards_.size();) {
+        const size_t begin = offsets_[shard];
+        const size_t size = GetShardSize(shard);
+        Builder<KeyType> chtb(keys[begin], keys[begin + size - 1], num_bins,
+                              max_error);
+        shards_[shard] = chtb.Build(keys + begin, size);
+      }
+    };
+    std::vector<std::thread> threads;
+    for (size_t index = 1; index < std::min(num_threads, shards_.size());
+         ++index)
+      threads.emplace_back(work);
+    work();
+    for (auto& thread : threads) thread.join();
+  }
+
+  // Returns a search bound [`begin`, `end`) around the estimated position.
+  SearchBound GetSearchBound(KeyType key) const {
+    const size_t shard = FindShard(key);
+    const auto bound = shards_[shard].GetSearchBound(key);
+    return {offsets_[shard] + bound.begin, offsets_[shard] + bound.end};
+  }
+
+  // Returns the position of the first key in `data` which is not less than
+  // `key`, where `data` holds the sorted keys the tree was built on. A key
+  // beyond the keys of its shard gets the first position of the next shard.
+  size_t LowerBound(const KeyType* data, KeyType key) const {
+    const size_t shard = FindShard(key);
+    return offsets_[shard] +
+           shards_[shard].LowerBound(data + offsets_[shard], key);
+  }
+
+  // Same, for keys stored in the member `key_member` of the sorted `rows`.
+  template <class Row>
+  size_t LowerBound(const Row* rows, KeyType Row::*key_member,
+                    KeyType key) const {
+    const size_t shard = FindShard(key);
+    return offsets_[shard] +
+           shards_[shard].LowerBound(rows + offsets_[shard], key_member, key);
+  }
+
+  size_t GetNumShards() const { return shards_.size(); }
+
+  // Returns the first position of `shard`.
+  size_t GetShardOffset(size_t shard) const { return offsets_[shard]; }
+
+  // Returns the number of keys of `shard`.
+  size_t GetShardSize(size_t shard) const {
+    return (shard + 1 == offsets_.size() ? num_keys_ : offsets_[shard + 1]) -
+           offsets_[shard];
+  }
+
+  const CompactHistTree<KeyType>& GetShard(size_t shard) const {
+    return shards_[shard];
+  }
+
+  // Replaces the tree of `shard`, e.g. by one rebuilt or mapped from a file.
+  // It must be built over the same keys.
+  void SetShard(size_t shard, CompactHistTree<KeyType> cht) {
+    shards_[shard] = std::move(cht);
+  }
+
+  // Returns the size in bytes.
+  size_t GetSize() const {
+    size_t size = sizeof(*this) + min_keys_.size() * sizeof(KeyType) +
+                  offsets_.size() * sizeof(size_t);
+    for (const auto& shard : shards_) size += shard.GetSize();
+    return size;
+  }
+
+  // Writes the router to `path`, and each shard `i` to `ShardPath(path, i)`.
+  void Serialize(const std::string& path) const {
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    if (!out.is_open()) throw std::runtime_error("unable to open " + path);
+    RouterHeader header;
+    std::memcpy(header.magic, kMagic, sizeof(kMagic));
+    header.key_size = sizeof(KeyType);
+    header.num_keys = num_keys_;
+    header.num_shards = shards_.size();
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    for (size_t shard = 0; shard != shards_.size(); ++shard) {
+      const uint64_t offset = offsets_[shard];
+      out.write(reinterpret_cast<const char*>(&min_keys_[shard]),
+                sizeof(KeyType));
+      out.write(reinterpret_cast<const char*>(&offset), sizeof(offset));
+    }
+    if (!out.good()) throw std::runtime_error("unable to write " + path);
+    for (size_t shard = 0; shard != shards_.size(); ++shard)
+      shards_[shard].Serialize(ShardPath(path, shard));
+  }
+
+  // Reads the router written by `Serialize` and memory-maps the shards.
+  static ShardedHistTree Map(const std::string& path) {
+    std::ifstream in(path, std::ios::binary);
+    if (!in.is_open()) throw std::runtime_error("unable to open " + path);
+    RouterHeader header;
+    in.read(reinterpret_cast<char*>(&header), sizeof(header));
+    if (!in.good() || std::memcmp(header.magic, kMagic, sizeof(kMagic)) != 0)
+      throw std::runtime_error(path + " is not a ShardedHistTree file");
+    if (header.key_size != sizeof(KeyType))
+      throw std::runtime_error(path + " was written for another key type");
+
+    ShardedHistTree sht;
+    sht.num_keys_ = header.num_keys;
+    sht.min_keys_.resize(header.num_shards);
+    sht.offsets_.resize(header.num_shards);
+    for (size_t shard = 0; shard != header.num_shards; ++shard) {
+      uint64_t offset;
+      in.read(reinterpret_cast<char*>(&sht.min_keys_[shard]), sizeof(KeyType));
+      in.read(reinterpret_cast<char*>(&offset), sizeof(offset));
+      sht.offsets_[shard] = offset;
+    }
+    if (!in.good()) throw std::runtime_error(path + " is truncated");
+    for (size_t shard = 0; shard != header.num_shards; ++shard) {
+      sht.shards_.push_back(
+          CompactHistTree<KeyType>::Map(ShardPath(path, shard)));
+    }
+    return sht;
+  }
+
+  // Returns the file of `shard` of the tree serialized to `path`.
+  static std::string ShardPath(const std::string& path, size_t shard) {
+    return path + "." + std::to_string(shard);
+  }
+
+ private:
+  static constexpr char kMagic[8] = {'C', 'H', 'T', 'S', 'H', 'A', 'R', 'D'};
+
+  struct RouterHeader {
+    char magic[8];
+    uint64_t key_size;
+    uint64_t num_keys;
+    uint64_t num_shards;
+  };
+
+  // Chooses the first positions of the shards. Each boundary moves back to
+  // the first duplicate of its key, and is dropped if the shard before it
+  // would span less than `num_bins` values.
+  void Partition(const KeyType* keys, size_t num_keys, size_t num_shards,
+                 size_t num_bins) {
+    const auto Spans = [&](size_t begin, size_t end) {
+      return static_cast<uint64_t>(keys[end - 1] - keys[begin]) >= num_bins;
+    };
+    offsets_ = {0};
+    for (size_t shard = 1; shard < num_shards; ++shard) {
+      size_t pos = shard * num_keys / num_shards;
+      pos = std::lower_bound(keys + offsets_.back(), keys + pos, keys[pos]) -
+            keys;
+      if (pos != offsets_.back() && Spans(offsets_.back(), pos))
+        offsets_.push_back(pos);
+    }
+    // The last shard joins the one before, if it is too narrow.
+    if (offsets_.size() > 1 && !Spans(offsets_.back(), num_keys))
+      offsets_.pop_back();
+    for (const size_t offset : offsets_) min_keys_.push_back(keys[offset]);
+  }
+
+  // Returns the last shard whose smallest key is not greater than `key`, or
+  // the first shard.
+  size_t FindShard(KeyType key) const {
+    const auto it = std::upper_bound(min_keys_.begin(), min_keys_.end(), key);
+    return it == min_keys_.begin() ? 0 : (it - min_keys_.begin()) - 1;
+  }
+
+  size_t num_keys_ = 0;
+  // The smallest key and the first position of each shard.
+  std::vector<KeyType> min_keys_;
+  std::vector<size_t> offsets_;
+  std::vector<CompactHistTree<KeyType>> shards_;
+};
+
+}  // namespace cht
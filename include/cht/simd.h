@@ -0,0 +1,358 @@
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CHT_X86_SIMD 1
+#endif
+
+namespace cht {
+namespace simd {
+
+// Instruction sets for which vectorized kernels exist.
+enum class Isa { Scalar, AVX2, AVX512 };
+
+namespace detail {
+
+// Returns the widest instruction set supported by the running CPU.
+inline Isa SupportedIsa() {
+#ifdef CHT_X86_SIMD
+  static const Isa isa = __builtin_cpu_supports("avx512f") ? Isa::AVX512
+                         : __builtin_cpu_supports("avx2")  ? Isa::AVX2
+                                                           : Isa::Scalar;
+  return isa;
+#else
+  return Isa::Scalar;
+#endif
+}
+
+inline Isa& ActiveIsa() {
+  static Isa isa = SupportedIsa();
+  return isa;
+}
+
+}  // namespace detail
+
+// Returns the instruction set of the kernels, i.e. the widest one supported
+// by the running CPU, unless limited by `SetMaxIsaForTesting`. The kernels
+// are compiled with function-level target attributes, so they do not depend
+// on the flags the including translation unit is compiled with.
+inline Isa DetectIsa() { return detail::ActiveIsa(); }
+
+// Makes the kernels use at most `isa`, such that the narrower kernels can be
+// tested on a wider CPU. `Isa::AVX512` restores the default. This is not
+// thread-safe, and only meant for tests.
+inline void SetMaxIsaForTesting(Isa isa) {
+  detail::ActiveIsa() = std::min(isa, detail::SupportedIsa());
+}
+
+// The state of a `CompactHistTree` needed to walk it.
+template <class KeyType>
+struct LookupArgs {
+  const unsigned* table;
+  KeyType min_key;
+  KeyType max_key;
+  unsigned shift;
+  unsigned log_num_bins;
+  // The position returned for keys > `max_key`.
+  size_t last;
+};
+
+// Whether the running CPU has a vectorized kernel for `KeyType`. With AVX2,
+// 64-bit keys only fit 4 lanes, which is slower than the scalar, prefetching
+// batch lookup, so there is no such kernel.
+template <class KeyType>
+bool HasKernel() {
+  constexpr bool is32 = std::is_same<KeyType, uint32_t>::value;
+  constexpr bool is64 = std::is_same<KeyType, uint64_t>::value;
+  switch (DetectIsa()) {
+    case Isa::AVX512:
+      return is32 || is64;
+    case Isa::AVX2:
+      return is32;
+    case Isa::Scalar:
+      break;
+  }
+  return false;
+}
+
+#ifdef CHT_X86_SIMD
+
+namespace internal {
+
+static constexpr unsigned Leaf = (1u << 31);
+static constexpr unsigned Mask = Leaf - 1;
+
+// All kernels walk the lanes in lock-step: every active lane is at the same
+// level, so the shift of the current level is shared by all of them. A lane
+// retires as soon as it hits a leaf, by removing it from the gather mask.
+
+__attribute__((target("avx2"))) inline void LookupAVX2(
+    const LookupArgs<uint32_t>& args, const uint32_t* keys, size_t* out) {
+  const __m256i key =
+      _mm256_loadu_si256(reinterpret_cast<const __m256i*>(keys));
+  const __m256i minKey = _mm256_set1_epi32(args.min_key);
+  const __m256i maxKey = _mm256_set1_epi32(args.max_key);
+
+  // Edge cases: unsigned comparisons via min / max. The last key may be
+  // duplicated, so its own lookup walks the tree.
+  const __m256i ones = _mm256_set1_epi32(-1);
+  const __m256i low = _mm256_cmpeq_epi32(_mm256_max_epu32(key, minKey), minKey);
+  const __m256i notHigh =
+      _mm256_cmpeq_epi32(_mm256_max_epu32(key, maxKey), maxKey);
+  const __m256i high = _mm256_andnot_si256(_mm256_or_si256(low, notHigh), ones);
+  __m256i active = _mm256_andnot_si256(_mm256_or_si256(low, high), ones);
+  __m256i pos = _mm256_and_si256(
+      high, _mm256_set1_epi32(static_cast<uint32_t>(args.last)));
+
+  const __m128i logNumBins = _mm_cvtsi32_si128(args.log_num_bins);
+  const __m256i mask = _mm256_set1_epi32(Mask);
+  __m256i curr = _mm256_sub_epi32(key, minKey);
+  __m256i node = _mm256_setzero_si256();
+  unsigned width = args.shift;
+  while (!_mm256_testz_si256(active, active)) {
+    // Gather the entries of the active lanes.
+    const __m128i count = _mm_cvtsi32_si128(width);
+    const __m256i index = _mm256_add_epi32(_mm256_sll_epi32(node, logNumBins),
+                                           _mm256_srl_epi32(curr, count));
+    const __m256i entry = _mm256_mask_i32gather_epi32(
+        _mm256_setzero_si256(), reinterpret_cast<const int*>(args.table),
+        index, active, 4);
+
+    // Retire the lanes which hit a leaf.
+    const __m256i leaf = _mm256_and_si256(_mm256_srai_epi32(entry, 31), active);
+    pos = _mm256_blendv_epi8(pos, _mm256_and_si256(entry, mask), leaf);
+    active = _mm256_andnot_si256(leaf, active);
+
+    // Prepare for the next level.
+    node = entry;
+    curr = _mm256_and_si256(
+        curr, _mm256_set1_epi32(static_cast<uint32_t>((1ull << width) - 1)));
+    width -= args.log_num_bins;
+  }
+
+  alignas(32) uint32_t tmp[8];
+  _mm256_store_si256(reinterpret_cast<__m256i*>(tmp), pos);
+  for (unsigned lane = 0; lane != 8; ++lane) out[lane] = tmp[lane];
+}
+
+__attribute__((target("avx512f"))) inline void LookupAVX512(
+    const LookupArgs<uint32_t>& args, const uint32_t* keys, size_t* out) {
+  const __m512i key = _mm512_loadu_si512(keys);
+  const __m512i minKey = _mm512_set1_epi32(args.min_key);
+
+  // Edge cases, as above.
+  const __mmask16 low = _mm512_cmple_epu32_mask(key, minKey);
+  const __mmask16 high =
+      _mm512_cmpgt_epu32_mask(key, _mm512_set1_epi32(args.max_key)) & ~low;
+  __mmask16 active = ~(low | high);
+  __m512i pos = _mm512_maskz_set1_epi32(high, static_cast<uint32_t>(args.last));
+
+  const __m128i logNumBins = _mm_cvtsi32_si128(args.log_num_bins);
+  const __m512i leafBit = _mm512_set1_epi32(Leaf);
+  const __m512i mask = _mm512_set1_epi32(Mask);
+  __m512i curr = _mm512_sub_epi32(key, minKey);
+  __m512i node = _mm512_setzero_si512();
+  unsigned width = args.shift;
+  while (active) {
+    // Gather the entries of the active lanes.
+    const __m128i count = _mm_cvtsi32_si128(width);
+    // The zero-masked shifts, unlike the plain ones, do not start from an
+    // undefined vector, which GCC reports as uninitialized.
+    const __m512i index =
+        _mm512_add_epi32(_mm512_maskz_sll_epi32(0xFFFF, node, logNumBins),
+                         _mm512_maskz_srl_epi32(0xFFFF, curr, count));
+    const __m512i entry = _mm512_mask_i32gather_epi32(
+        _mm512_setzero_si512(), active, index, args.table, 4);
+
+    // Retire the lanes which hit a leaf.
+    const __mmask16 leaf = _mm512_mask_test_epi32_mask(active, entry, leafBit);
+    pos = _mm512_mask_and_epi32(pos, leaf, entry, mask);
+    active &= ~leaf;
+
+    // Prepare for the next level.
+    node = entry;
+    curr = _mm512_and_si512(
+        curr, _mm512_set1_epi32(static_cast<uint32_t>((1ull << width) - 1)));
+    width -= args.log_num_bins;
+  }
+
+  _mm512_storeu_si512(
+      out, _mm512_maskz_cvtepu32_epi64(
+               0xFF, _mm512_maskz_extracti64x4_epi64(0xFF, pos, 0)));
+  _mm512_storeu_si512(
+      out + 8, _mm512_maskz_cvtepu32_epi64(
+                   0xFF, _mm512_maskz_extracti64x4_epi64(0xFF, pos, 1)));
+}
+
+__attribute__((target("avx512f"))) inline void LookupAVX512(
+    const LookupArgs<uint64_t>& args, const uint64_t* keys, size_t* out) {
+  const __m512i key = _mm512_loadu_si512(keys);
+  const __m512i minKey = _mm512_set1_epi64(args.min_key);
+
+  // Edge cases, as above.
+  const __mmask8 low = _mm512_cmple_epu64_mask(key, minKey);
+  const __mmask8 high =
+      _mm512_cmpgt_epu64_mask(key, _mm512_set1_epi64(args.max_key)) & ~low;
+  __mmask8 active = ~(low | high);
+  __m512i pos = _mm512_maskz_set1_epi64(high, args.last);
+
+  const __m128i logNumBins = _mm_cvtsi32_si128(args.log_num_bins);
+  const __m512i leafBit = _mm512_set1_epi64(Leaf);
+  const __m512i mask = _mm512_set1_epi64(Mask);
+  __m512i curr = _mm512_sub_epi64(key, minKey);
+  __m512i node = _mm512_setzero_si512();
+  unsigned width = args.shift;
+  while (active) {
+    // Gather the entries of the active lanes.
+    const __m128i count = _mm_cvtsi32_si128(width);
+    // As above, with zero-masked shifts and conversions.
+    const __m512i index =
+        _mm512_add_epi64(_mm512_maskz_sll_epi64(0xFF, node, logNumBins),
+                         _mm512_maskz_srl_epi64(0xFF, curr, count));
+    const __m512i entry = _mm512_maskz_cvtepu32_epi64(
+        0xFF, _mm512_mask_i64gather_epi32(_mm256_setzero_si256(), active,
+                                          index, args.table, 4));
+
+    // Retire the lanes which hit a leaf.
+    const __mmask8 leaf = _mm512_mask_test_epi64_mask(active, entry, leafBit);
+    pos = _mm512_mask_and_epi64(pos, leaf, entry, mask);
+    active &= ~leaf;
+
+    // Prepare for the next level.
+    node = entry;
+    curr = _mm512_and_si512(curr, _mm512_set1_epi64((1ull << width) - 1));
+    width -= args.log_num_bins;
+  }
+
+  _mm512_storeu_si512(out, pos);
+}
+
+// The scan kernels count the keys less than `key`. Since the keys are sorted,
+// the count is the offset of the lower bound. There is no unsigned compare in
+// AVX2, so both sides are compared signed after flipping their sign bits.
+
+__attribute__((target("avx2"))) inline size_t CountLessAVX2(
+    const uint32_t* data, size_t size, uint32_t key) {
+  const __m256i sign = _mm256_set1_epi32(0x80000000u);
+  const __m256i needle = _mm256_xor_si256(_mm256_set1_epi32(key), sign);
+  size_t count = 0, index = 0;
+  for (; index + 8 <= size; index += 8) {
+    const __m256i curr = _mm256_xor_si256(
+        _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + index)),
+        sign);
+    const int less =
+        _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(needle, curr)));
+    count += __builtin_popcount(less);
+  }
+  for (; index != size; ++index) count += data[index] < key;
+  return count;
+}
+
+__attribute__((target("avx2"))) inline size_t CountLessAVX2(
+    const uint64_t* data, size_t size, uint64_t key) {
+  const __m256i sign = _mm256_set1_epi64x(0x8000000000000000ull);
+  const __m256i needle = _mm256_xor_si256(_mm256_set1_epi64x(key), sign);
+  size_t count = 0, index = 0;
+  for (; index + 4 <= size; index += 4) {
+    const __m256i curr = _mm256_xor_si256(
+        _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + index)),
+        sign);
+    const int less = _mm256_movemask_pd(
+        _mm256_castsi256_pd(_mm256_cmpgt_epi64(needle, curr)));
+    count += __builtin_popcount(less);
+  }
+  for (; index != size; ++index) count += data[index] < key;
+  return count;
+}
+
+// The tail is read with a masked load, which does not fault beyond `size`.
+__attribute__((target("avx512f"))) inline size_t CountLessAVX512(
+    const uint32_t* data, size_t size, uint32_t key) {
+  const __m512i needle = _mm512_set1_epi32(key);
+  size_t count = 0;
+  for (size_t index = 0; index < size; index += 16) {
+    const __mmask16 valid =
+        size - index >= 16 ? __mmask16(0xffff)
+                           : __mmask16((1u << (size - index)) - 1);
+    const __m512i curr = _mm512_maskz_loadu_epi32(valid, data + index);
+    count += __builtin_popcount(_mm512_mask_cmplt_epu32_mask(valid, curr, needle));
+  }
+  return count;
+}
+
+__attribute__((target("avx512f"))) inline size_t CountLessAVX512(
+    const uint64_t* data, size_t size, uint64_t key) {
+  const __m512i needle = _mm512_set1_epi64(key);
+  size_t count = 0;
+  for (size_t index = 0; index < size; index += 8) {
+    const __mmask8 valid = size - index >= 8
+                               ? __mmask8(0xff)
+                               : __mmask8((1u << (size - index)) - 1);
+    const __m512i curr = _mm512_maskz_loadu_epi64(valid, data + index);
+    count += __builtin_popcount(_mm512_mask_cmplt_epu64_mask(valid, curr, needle));
+  }
+  return count;
+}
+
+}  // namespace internal
+
+#endif
+
+// Number of keys a call to `Lookup` consumes at once.
+static constexpr size_t kBlockSize = 16;
+
+// Computes the estimated positions of the `kBlockSize` keys in `keys` with
+// the widest kernel available. Must only be called if `HasKernel<KeyType>()`
+// holds. The 32-bit kernels index the table with signed 32-bit offsets, so
+// the caller must not use them on tables with 2^31 entries or more.
+template <class KeyType>
+void Lookup(const LookupArgs<KeyType>& args, const KeyType* keys,
+            size_t* out) {
+  assert(HasKernel<KeyType>());
+#ifdef CHT_X86_SIMD
+  if constexpr (std::is_same<KeyType, uint32_t>::value ||
+                std::is_same<KeyType, uint64_t>::value) {
+    if (DetectIsa() == Isa::AVX512) {
+      constexpr size_t lanes = 64 / sizeof(KeyType);
+      for (size_t offset = 0; offset != kBlockSize; offset += lanes)
+        internal::LookupAVX512(args, keys + offset, out + offset);
+      return;
+    }
+  }
+  if constexpr (std::is_same<KeyType, uint32_t>::value) {
+    for (size_t offset = 0; offset != kBlockSize; offset += 8)
+      internal::LookupAVX2(args, keys + offset, out + offset);
+  }
+#endif
+}
+
+// Returns the number of the `size` sorted keys at `data` which are less than
+// `key`, with the widest kernel available.
+template <class KeyType>
+size_t CountLess(const KeyType* data, size_t size, KeyType key) {
+#ifdef CHT_X86_SIMD
+  if constexpr (std::is_same<KeyType, uint32_t>::value ||
+                std::is_same<KeyType, uint64_t>::value) {
+    switch (DetectIsa()) {
+      case Isa::AVX512:
+        return internal::CountLessAVX512(data, size, key);
+      case Isa::AVX2:
+        return internal::CountLessAVX2(data, size, key);
+      case Isa::Scalar:
+        break;
+    }
+  }
+#endif
+  size_t count = 0;
+  for (size_t index = 0; index != size; ++index) count += data[index] < key;
+  return count;
+}
+
+}  // namespace simd
+}  // namespace cht
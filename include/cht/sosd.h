@@ -0,0 +1,113 @@
+#pragma once
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <string>
+
+#include "builder.h"
+#include "cht.h"
+
+namespace cht {
+
+// A read-only memory-mapped file in the SOSD format, i.e. the number of
+// values as a `uint64_t`, followed by the packed values. The values are read
+// from the page cache, so the file may be larger than the memory.
+template <class T>
+class SosdFile {
+ public:
+  explicit SosdFile(const std::string& path) {
+    const int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd == -1) throw std::runtime_error("unable to open " + path);
+    struct stat st;
+    if (::fstat(fd, &st) == -1 ||
+        static_cast<size_t>(st.st_size) < sizeof(uint64_t)) {
+      ::close(fd);
+      throw std::runtime_error(path + " is not a SOSD file");
+    }
+    const size_t fileSize = st.st_size;
+    void* addr = ::mmap(nullptr, fileSize, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (addr == MAP_FAILED) throw std::runtime_error("unable to map " + path);
+    memory_ = std::shared_ptr<const void>(
+        addr, [fileSize](const void* ptr) {
+          ::munmap(const_cast<void*>(ptr), fileSize);
+        });
+    // The values are read front to back, which lets the kernel read ahead
+    // more.
+    ::madvise(addr, fileSize, MADV_SEQUENTIAL);
+
+    uint64_t size;
+    std::memcpy(&size, addr, sizeof(size));
+    if (size > (fileSize - sizeof(uint64_t)) / sizeof(T))
+      throw std::runtime_error(path + " is truncated");
+    data_ = reinterpret_cast<const T*>(static_cast<const char*>(addr) +
+                                       sizeof(uint64_t));
+    size_ = size;
+  }
+
+  const T* data() const { return data_; }
+  size_t size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+  const T& operator[](size_t index) const { return data_[index]; }
+  const T& front() const { return data_[0]; }
+  const T& back() const { return data_[size_ - 1]; }
+
+  // Calls `func(value)` for all values, in order. The pages of the values
+  // already visited are released from this mapping in chunks, so they count
+  // towards the resident set of the process only for about one chunk. The
+  // page cache may still hold them, and they are mapped again if accessed
+  // later.
+  template <class Func>
+  void ForEach(Func func) const {
+    const auto* base = static_cast<const char*>(memory_.get());
+    const size_t pageSize = ::sysconf(_SC_PAGESIZE);
+    size_t released = 0;
+    for (size_t begin = 0; begin < size_; begin += kValuesPerChunk) {
+      const size_t end = std::min(size_, begin + kValuesPerChunk);
+      for (size_t index = begin; index != end; ++index) func(data_[index]);
+
+      // Release the pages which only hold values up to `end`.
+      const size_t done =
+          (sizeof(uint64_t) + end * sizeof(T)) / pageSize * pageSize;
+      if (done > released) {
+        ::madvise(const_cast<char*>(base) + released, done - released,
+                  MADV_DONTNEED);
+        released = done;
+      }
+    }
+  }
+
+ private:
+  static constexpr size_t kValuesPerChunk = (size_t(64) << 20) / sizeof(T);
+
+  std::shared_ptr<const void> memory_;
+  const T* data_ = nullptr;
+  size_t size_ = 0;
+};
+
+// Builds a tree over the sorted keys of the SOSD file at `path`, with the
+// single-pass build. The keys are streamed from the file without copying
+// them, so the process holds about one chunk of them besides the tree. With
+// `use_cache`, the tree has the cache-oblivious layout.
+template <class KeyType>
+CompactHistTree<KeyType> BuildFromSosdFile(const std::string& path,
+                                           size_t num_bins, size_t max_error,
+                                           bool use_cache = false) {
+  const SosdFile<KeyType> keys(path);
+  if (keys.empty()) throw std::runtime_error(path + " has no keys");
+  Builder<KeyType> chtb(keys.front(), keys.back(), num_bins, max_error,
+                        /*single_pass=*/true, use_cache);
+  keys.ForEach([&](KeyType key) { chtb.AddKey(key); });
+  return chtb.Finalize();
+}
+
+}  // namespace cht
@@ -0,0 +1,134 @@
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <utility>
+
+#include "cht.h"
+#include "common.h"
+
+namespace cht {
+
+// A read-only view of a `CompactHistTree` whose fanout is a compile-time
+// constant. The shifts and masks of `Lookup` then become immediates, and the
+// walk is unrolled up to the maximum depth of a tree over `KeyType`.
+template <class KeyType, size_t NumBins>
+class StaticCompactHistTree {
+  static_assert(NumBins >= 2 && (NumBins & (NumBins - 1)) == 0,
+                "`NumBins` must be a power of two");
+
+ public:
+  explicit StaticCompactHistTree(const CompactHistTree<KeyType>& cht)
+      : min_key_(cht.min_key_),
+        max_key_(cht.max_key_),
+        num_keys_(cht.num_keys_),
+        max_error_(cht.max_error_),
+        shift_(cht.shift_),
+        tight_bounds_(cht.tight_bounds_),
+        table_(cht.table_) {
+    assert(cht.num_bins_ == NumBins);
+    assert(!cht.wide_);
+    assert(cht.layout_ == Layout::Uniform);
+    assert(!cht.IsInterpolated());
+  }
+
+  // Returns a search bound [`begin`, `end`) around the estimated position.
+  SearchBound GetSearchBound(const KeyType key) const {
+    // Edge cases
+    if (key <= min_key_) return ToSearchBound(0);
+    // The last key may be duplicated, so its own lookup walks the tree.
+    if (key > max_key_) return ToSearchBound(num_keys_ - 1);
+
+    const size_t index = Lookup(key - min_key_);
+    auto bound = ToSearchBound(table_[index] & Mask);
+    // With tight bounds, the bound ends at the next bin of the same node, as
+    // in `CompactHistTree`.
+    if (tight_bounds_ && ((index + 1) & (NumBins - 1)) &&
+        (table_[index + 1] & Leaf))
+      bound.end = std::min<size_t>(bound.end, table_[index + 1] & Mask);
+    return bound;
+  }
+
+  // Returns the size in bytes.
+  size_t GetSize() const {
+    return sizeof(*this) + table_.size() * sizeof(unsigned);
+  }
+
+ private:
+  static constexpr unsigned Leaf = EntryTraits<unsigned>::Leaf;
+  static constexpr unsigned Mask = EntryTraits<unsigned>::Mask;
+
+  static constexpr unsigned kLogNumBins = __builtin_ctzll(NumBins);
+  // Each level consumes `kLogNumBins` bits of the key.
+  static constexpr unsigned kMaxDepth =
+      (8 * sizeof(KeyType) + kLogNumBins - 1) / kLogNumBins;
+
+  SearchBound ToSearchBound(size_t begin) const {
+    // `end` is exclusive.
+    const size_t end = (begin + max_error_ + 1 > num_keys_)
+                           ? num_keys_
+                           : (begin + max_error_ + 1);
+    return SearchBound{begin, end};
+  }
+
+  // Returns the index of the leaf entry of `key`, relative to `min_key_`.
+  size_t Lookup(KeyType key) const {
+    // The root may have more bins than the other nodes.
+    size_t index = key >> shift_;
+    size_t next = table_[index];
+    if (next & Leaf) return index;
+
+    // Since the nodes cover aligned ranges, the bin of a level can be masked
+    // out of the key, instead of subtracting the bins of the upper levels.
+#pragma GCC unroll 8
+    for (unsigned level = 1; level != kMaxDepth; ++level) {
+      const size_t bin = (key >> (shift_ - level * kLogNumBins)) & (NumBins - 1);
+      index = (next << kLogNumBins) + bin;
+      next = table_[index];
+
+      // Is it a leaf?
+      if (next & Leaf) return index;
+    }
+    assert(false);
+    return index;
+  }
+
+  KeyType min_key_;
+  KeyType max_key_;
+  size_t num_keys_;
+  size_t max_error_;
+  size_t shift_;
+  bool tight_bounds_;
+
+  Table<unsigned> table_;
+};
+
+namespace internal {
+
+template <class KeyType, class Func, size_t... LogNumBins>
+bool WithStaticFanout(const CompactHistTree<KeyType>& cht, Func&& func,
+                      std::index_sequence<LogNumBins...>) {
+  const auto numBins = cht.GetNumBins();
+  if (cht.HasWideEntries() || cht.GetLayout() != Layout::Uniform ||
+      cht.IsInterpolated())
+    return false;
+  return ((numBins == (size_t(2) << LogNumBins)
+               ? (func(StaticCompactHistTree<KeyType, (size_t(2) << LogNumBins)>(
+                      cht)),
+                  true)
+               : false) ||
+          ...);
+}
+
+}  // namespace internal
+
+// Calls `func` with the `StaticCompactHistTree` of `cht`, if its fanout is one
+// of the powers of two in [2, 1024] and it has 32-bit table entries in the
+// uniform layout, without interpolation. Returns whether `func` was called.
+template <class KeyType, class Func>
+bool WithStaticFanout(const CompactHistTree<KeyType>& cht, Func&& func) {
+  return internal::WithStaticFanout(cht, std::forward<Func>(func),
+                                    std::make_index_sequence<10>());
+}
+
+}  // namespace cht
@@ -0,0 +1,139 @@
+#pragma once
+
+#include <sys/mman.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <vector>
+
+namespace cht {
+
+// The tables are aligned to cache lines, so that the nodes of at least 16
+// 32-bit entries never straddle two of them.
+constexpr size_t kCacheLineSize = 64;
+// Tables of at least this size are backed by transparent huge pages, which
+// cover the random accesses of the lookups with far fewer TLB entries.
+constexpr size_t kHugePageSize = size_t(2) << 20;
+
+// Allocates the entries of a table under construction. Large tables are
+// mapped at a huge page boundary and advised to use huge pages, unless
+// `huge_pages` is false, and small ones are aligned to a cache line.
+template <class T>
+class TableAllocator {
+ public:
+  using value_type = T;
+  using propagate_on_container_move_assignment = std::true_type;
+  using propagate_on_container_swap = std::true_type;
+
+  explicit TableAllocator(bool huge_pages = true) : huge_pages_(huge_pages) {}
+
+  template <class U>
+  TableAllocator(const TableAllocator<U>& other)
+      : huge_pages_(other.huge_pages()) {}
+
+  T* allocate(size_t n) {
+    const size_t bytes = n * sizeof(T);
+    if (!UseHugePages(bytes)) {
+      return static_cast<T*>(
+          ::operator new(bytes, std::align_val_t(kCacheLineSize)));
+    }
+
+    // Over-allocate by a huge page, and unmap the unaligned head and tail.
+    const size_t size = AllocatedBytes(n);
+    void* memory = mmap(nullptr, size + kHugePageSize, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) throw std::bad_alloc();
+    const auto begin = reinterpret_cast<uintptr_t>(memory);
+    const auto aligned = (begin + kHugePageSize - 1) & ~(kHugePageSize - 1);
+    if (aligned != begin) munmap(memory, aligned - begin);
+    munmap(reinterpret_cast<void*>(aligned + size),
+           begin + kHugePageSize - aligned);
+#ifdef MADV_HUGEPAGE
+    madvise(reinterpret_cast<void*>(aligned), size, MADV_HUGEPAGE);
+#endif
+    return reinterpret_cast<T*>(aligned);
+  }
+
+  void deallocate(T* data, size_t n) {
+    const size_t bytes = n * sizeof(T);
+    if (!UseHugePages(bytes)) {
+      ::operator delete(data, std::align_val_t(kCacheLineSize));
+      return;
+    }
+    munmap(data, AllocatedBytes(n));
+  }
+
+  // Returns the number of bytes reserved for `n` entries.
+  size_t AllocatedBytes(size_t n) const {
+    const size_t bytes = n * sizeof(T);
+    if (!UseHugePages(bytes))
+      return (bytes + kCacheLineSize - 1) & ~(kCacheLineSize - 1);
+    return (bytes + kHugePageSize - 1) & ~(kHugePageSize - 1);
+  }
+
+  bool huge_pages() const { return huge_pages_; }
+
+  template <class U>
+  bool operator==(const TableAllocator<U>& other) const {
+    return huge_pages_ == other.huge_pages();
+  }
+  template <class U>
+  bool operator!=(const TableAllocator<U>& other) const {
+    return !(*this == other);
+  }
+
+ private:
+  bool UseHugePages(size_t bytes) const {
+    return huge_pages_ && bytes >= kHugePageSize;
+  }
+
+  bool huge_pages_;
+};
+
+// The entries of a table under construction.
+template <class Entry>
+using TableVector = std::vector<Entry, TableAllocator<Entry>>;
+
+// Read-only array of table entries. The memory is either owned or belongs to
+// a memory-mapped file. Since the table is immutable, copies share it.
+template <class Entry>
+class Table {
+ public:
+  Table() = default;
+
+  explicit Table(TableVector<Entry> entries) {
+    auto owned =
+        std::make_shared<const TableVector<Entry>>(std::move(entries));
+    data_ = owned->data();
+    size_ = owned->size();
+    allocated_bytes_ = owned->get_allocator().AllocatedBytes(owned->capacity());
+    memory_ = std::move(owned);
+  }
+
+  // Wraps `size` entries at `data`, which stay valid as long as `memory` is
+  // alive.
+  Table(std::shared_ptr<const void> memory, const Entry* data, size_t size)
+      : memory_(std::move(memory)),
+        data_(data),
+        size_(size),
+        allocated_bytes_(size * sizeof(Entry)) {}
+
+  const Entry& operator[](size_t index) const { return data_[index]; }
+  const Entry* data() const { return data_; }
+  size_t size() const { return size_; }
+
+  // Returns the number of bytes reserved for the entries, which exceeds the
+  // size of the entries by the alignment and the unused capacity.
+  size_t allocated_bytes() const { return allocated_bytes_; }
+
+ private:
+  std::shared_ptr<const void> memory_;
+  const Entry* data_ = nullptr;
+  size_t size_ = 0;
+  size_t allocated_bytes_ = 0;
+};
+
+}  // namespace cht
@@ -0,0 +1,235 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <limits>
+#include <vector>
+
+#include "builder.h"
+#include "cht.h"
+#include "common.h"
+
+namespace cht {
+
+// The parameters chosen by `Tune`.
+struct TunedParameters {
+  size_t num_bins;
+  size_t max_error;
+  // The estimated size of the tree in bytes.
+  size_t size;
+  // The measured time of a `LowerBound` on the sample queries, or 0 if it was
+  // not measured.
+  double lookup_ns;
+};
+
+namespace internal {
+
+// The number of keys in the aligned blocks of `2^width` keys of the range,
+// for all widths, which are collected in a single pass over the keys. Since
+// the nodes of a tree cover such blocks, and a bin is split as soon as it has
+// more than `max_error` keys, they give the nodes of all trees over the keys.
+template <class KeyType>
+class BlockStatistics {
+ public:
+  explicit BlockStatistics(const std::vector<KeyType>& keys)
+      : num_keys_(keys.size()) {
+    assert(!keys.empty());
+    const uint64_t range = keys.back() - keys.front();
+    // The width of the root, as in `Builder`.
+    log_range_ =
+        range ? 63 - __builtin_clzll(range) + ((range & (range - 1)) != 0) : 0;
+
+    // A block of width `w` ends where the bits from `w` on change, i.e. at
+    // the keys which differ from the previous one in bit `w` or above.
+    std::array<size_t, kMaxWidth + 1> begin = {};
+    for (size_t index = 1; index != keys.size(); ++index) {
+      const uint64_t diff = static_cast<uint64_t>(keys[index] - keys.front()) ^
+                            (keys[index - 1] - keys.front());
+      if (!diff) continue;
+      const unsigned top = std::min<unsigned>(63 - __builtin_clzll(diff),
+                                              log_range_);
+      for (unsigned width = 0; width <= top; ++width) {
+        Add(width, index - begin[width]);
+        begin[width] = index;
+      }
+    }
+    for (unsigned width = 0; width <= log_range_; ++width)
+      Add(width, keys.size() - begin[width]);
+  }
+
+  unsigned GetLogRange() const { return log_range_; }
+
+  // Returns the number of blocks of `2^width` keys with more than `2^lg`
+  // keys, and the number of keys in them.
+  std::pair<size_t, size_t> CountAbove(unsigned width, unsigned lg) const {
+    std::pair<size_t, size_t> result = {0, 0};
+    for (unsigned bucket = lg + 1; bucket <= kMaxBucket; ++bucket) {
+      result.first += num_blocks_[width][bucket];
+      result.second += num_keys_in_[width][bucket];
+    }
+    return result;
+  }
+
+  size_t GetNumKeys() const { return num_keys_; }
+
+ private:
+  static constexpr unsigned kMaxWidth = 64;
+  static constexpr unsigned kMaxBucket = 64;
+
+  // Adds a block of `size` keys, in the bucket of `ceil(log2(size))`.
+  void Add(unsigned width, size_t size) {
+    const unsigned bucket = size <= 1 ? 0 : 64 - __builtin_clzll(size - 1);
+    ++num_blocks_[width][bucket];
+    num_keys_in_[width][bucket] += size;
+  }
+
+  size_t num_keys_;
+  unsigned log_range_;
+  std::array<std::array<size_t, kMaxBucket + 1>, kMaxWidth + 1> num_blocks_ =
+      {};
+  std::array<std::array<size_t, kMaxBucket + 1>, kMaxWidth + 1> num_keys_in_ =
+      {};
+};
+
+// The estimated shape of a tree.
+struct TreeEstimate {
+  size_t num_nodes;
+  // The average number of levels walked by a lookup of a key.
+  double depth;
+  bool valid;
+};
+
+// Estimates the tree of `2^log_num_bins` bins per node and a maximum error of
+// `2^log_max_error`. The estimate is exact for unique keys. The tree is not
+// valid if a node would have bins narrower than a single key.
+template <class KeyType>
+TreeEstimate EstimateTree(const BlockStatistics<KeyType>& stats,
+                          unsigned log_num_bins, unsigned log_max_error) {
+  TreeEstimate estimate = {1, 1, true};
+  const unsigned logRange = stats.GetLogRange();
+  // The bins of level `level` have the width `logRange - (level + 1) *
+  // log_num_bins`, and a bin with too many keys becomes a node of the next
+  // level.
+  for (unsigned level = 0; (level + 1) * log_num_bins <= logRange; ++level) {
+    const unsigned width = logRange - (level + 1) * log_num_bins;
+    const auto [numBlocks, numKeys] = stats.CountAbove(width, log_max_error);
+    if (!numBlocks) break;
+    if (width < log_num_bins) estimate.valid = false;
+    estimate.num_nodes += numBlocks;
+    estimate.depth += static_cast<double>(numKeys) / stats.GetNumKeys();
+  }
+  return estimate;
+}
+
+}  // namespace internal
+
+// Chooses `num_bins` and `max_error` for the sorted `keys`, such that the tree
+// takes at most `memory_budget` bytes. The size and the lookup depth of all
+// candidates, with up to 1024 bins and a maximum error of up to 1024, are
+// estimated from a single pass over the keys. Only the `num_candidates` best
+// ones by estimate are then built and timed on `sample_queries`, and the
+// fastest one is returned. Without queries, the best estimate is returned. If
+// no candidate fits into the budget, the smallest one is returned. If the
+// keys span a range of at most 1, e.g. all are equal, there is no candidate,
+// and a single node of 2 bins with a `max_error` covering all keys is
+// returned without timing.
+template <class KeyType>
+TunedParameters Tune(const std::vector<KeyType>& keys,
+                     const std::vector<KeyType>& sample_queries,
+                     size_t memory_budget, size_t num_candidates = 3) {
+  assert(!keys.empty());
+  const internal::BlockStatistics<KeyType> stats(keys);
+  if (!stats.GetLogRange()) {
+    return {2, keys.size(),
+            sizeof(CompactHistTree<KeyType>) + 2 * sizeof(unsigned), 0};
+  }
+
+  struct Candidate {
+    TunedParameters params;
+    // The estimated cost of a lookup, in dependent cache misses.
+    double cost;
+  };
+  std::vector<Candidate> candidates, all;
+  for (unsigned logNumBins = 1;
+       logNumBins <= std::min(10u, stats.GetLogRange()); ++logNumBins) {
+    for (unsigned logMaxError = 1; logMaxError <= 10; ++logMaxError) {
+      const auto estimate =
+          internal::EstimateTree(stats, logNumBins, logMaxError);
+      if (!estimate.valid) continue;
+
+      // A level costs a cache miss, and so do the cache lines of the binary
+      // search over the bound.
+      const size_t maxError = size_t(1) << logMaxError;
+      const size_t numEntries = estimate.num_nodes << logNumBins;
+      const size_t entrySize =
+          (keys.size() > EntryTraits<unsigned>::Mask ||
+           estimate.num_nodes > EntryTraits<unsigned>::Mask)
+              ? sizeof(uint64_t)
+              : sizeof(unsigned);
+      const double boundLines = static_cast<double>(maxError + 1) *
+                                sizeof(KeyType) / kCacheLineSize;
+      const Candidate candidate = {
+          {size_t(1) << logNumBins, maxError,
+           sizeof(CompactHistTree<KeyType>) + numEntries * entrySize, 0},
+          estimate.depth + 1 + std::log2(std::max(boundLines, 1.0))};
+      all.push_back(candidate);
+      if (candidate.params.size <= memory_budget)
+        candidates.push_back(candidate);
+    }
+  }
+  assert(!all.empty());
+  if (candidates.empty()) {
+    return std::min_element(all.begin(), all.end(),
+                            [](const Candidate& lhs, const Candidate& rhs) {
+                              return lhs.params.size < rhs.params.size;
+                            })
+        ->params;
+  }
+
+  // Prefer the smaller tree among equally fast ones.
+  std::sort(candidates.begin(), candidates.end(),
+            [](const Candidate& lhs, const Candidate& rhs) {
+              return lhs.cost != rhs.cost ? lhs.cost < rhs.cost
+                                          : lhs.params.size < rhs.params.size;
+            });
+  if (sample_queries.empty()) return candidates.front().params;
+  candidates.resize(
+      std::min(candidates.size(), std::max<size_t>(num_candidates, 1)));
+
+  // Time the lookups of the remaining candidates, each the best of 3 runs.
+  for (auto& candidate : candidates) {
+    Builder<KeyType> chtb(keys.front(), keys.back(),
+                          candidate.params.num_bins,
+                          candidate.params.max_error);
+    for (const auto& key : keys) chtb.AddKey(key);
+    const auto cht = chtb.Finalize();
+
+    double best = std::numeric_limits<double>::max();
+    size_t checksum = 0;
+    for (unsigned run = 0; run != 3; ++run) {
+      const auto start = std::chrono::steady_clock::now();
+      for (const auto& query : sample_queries)
+        checksum += cht.LowerBound(keys.data(), query);
+      const auto stop = std::chrono::steady_clock::now();
+      best = std::min(
+          best, static_cast<double>(
+                    std::chrono::duration_cast<std::chrono::nanoseconds>(
+                        stop - start)
+                        .count()));
+    }
+    // Keeps the lookups from being optimized away.
+    if (checksum == std::numeric_limits<size_t>::max()) best = 0;
+    candidate.params.lookup_ns = best / sample_queries.size();
+  }
+  return std::min_element(candidates.begin(), candidates.end(),
+                          [](const Candidate& lhs, const Candidate& rhs) {
+                            return lhs.params.lookup_ns < rhs.params.lookup_ns;
+                          })
+      ->params;
+}
+
+}  // namespace cht
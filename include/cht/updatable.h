@@ -0,0 +1,206 @@
+#pragma once
+
+#include <algorithm>
+#include <condition_variable>
+#include <iterator>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <thread>
+#include <vector>
+
+#include "builder.h"
+#include "cht.h"
+
+namespace cht {
+
+// A sorted multiset of keys which accepts inserts. The keys are indexed by a
+// `CompactHistTree`, and new keys are first kept in a sorted delta buffer.
+// Once the buffer holds `merge_threshold` keys, a background thread merges it
+// into the keys and builds a new tree, which then replaces the old one. The
+// lookups are never blocked by the rebuild: they use the previous tree plus
+// the buffer until the new tree is swapped in.
+template <class KeyType>
+class UpdatableCompactHistTree {
+ public:
+  static constexpr size_t kDefaultMergeThreshold = size_t(1) << 16;
+
+  // `keys` must be sorted. As for `Builder`, the keys must span a range of at
+  // least `num_bins` values, now and after every merge.
+  UpdatableCompactHistTree(std::vector<KeyType> keys, size_t num_bins,
+                           size_t max_error,
+                           size_t merge_threshold = kDefaultMergeThreshold)
+      : num_bins_(num_bins),
+        max_error_(max_error),
+        merge_threshold_(std::max<size_t>(merge_threshold, 1)),
+        base_(Build(std::move(keys))),
+        frozen_(std::make_shared<const std::vector<KeyType>>()),
+        merger_([this] { MergeLoop(); }) {}
+
+  UpdatableCompactHistTree(const UpdatableCompactHistTree&) = delete;
+  UpdatableCompactHistTree& operator=(const UpdatableCompactHistTree&) =
+      delete;
+
+  ~UpdatableCompactHistTree() {
+    {
+      std::lock_guard<std::shared_mutex> lock(mutex_);
+      stop_ = true;
+    }
+    merge_cv_.notify_one();
+    merger_.join();
+  }
+
+  // Inserts `key`, which may already be present.
+  void Insert(KeyType key) {
+    bool merge;
+    {
+      std::lock_guard<std::shared_mutex> lock(mutex_);
+      delta_.insert(std::upper_bound(delta_.begin(), delta_.end(), key), key);
+      merge = delta_.size() >= merge_threshold_;
+    }
+    if (merge) merge_cv_.notify_one();
+  }
+
+  // Returns the number of keys less than `key`, i.e. the position of the
+  // lower bound of `key` in the sorted sequence of all keys.
+  size_t Rank(KeyType key) const {
+    const auto view = GetView(key);
+    const auto& frozen = *view.frozen;
+    return view.delta_rank + BaseRank(*view.base, key) +
+           (std::lower_bound(frozen.begin(), frozen.end(), key) -
+            frozen.begin());
+  }
+
+  // Whether `key` was inserted or passed at construction.
+  bool Contains(KeyType key) const {
+    const auto view = GetView(key);
+    if (view.delta_contains) return true;
+    if (std::binary_search(view.frozen->begin(), view.frozen->end(), key))
+      return true;
+    const auto& base = *view.base;
+    const size_t pos = BaseRank(base, key);
+    return pos < base.keys.size() && base.keys[pos] == key;
+  }
+
+  // Returns the number of keys.
+  size_t size() const {
+    std::shared_lock<std::shared_mutex> lock(mutex_);
+    return base_->keys.size() + frozen_->size() + delta_.size();
+  }
+
+  // Blocks until all keys inserted so far are indexed by the tree.
+  void Flush() {
+    std::unique_lock<std::shared_mutex> lock(mutex_);
+    ++num_flushing_;
+    merge_cv_.notify_one();
+    flushed_cv_.wait(lock, [this] {
+      return stop_ || (delta_.empty() && frozen_->empty());
+    });
+    --num_flushing_;
+  }
+
+  // Returns the size in bytes, including the keys.
+  size_t GetSize() const {
+    std::shared_lock<std::shared_mutex> lock(mutex_);
+    return sizeof(*this) + base_->cht.GetSize() +
+           (base_->keys.size() + frozen_->size() + delta_.size()) *
+               sizeof(KeyType);
+  }
+
+ private:
+  // The keys indexed by a tree.
+  struct Base {
+    std::vector<KeyType> keys;
+    CompactHistTree<KeyType> cht;
+  };
+
+  // A consistent state of the keys, taken under the lock.
+  struct View {
+    std::shared_ptr<const Base> base;
+    std::shared_ptr<const std::vector<KeyType>> frozen;
+    size_t delta_rank;
+    bool delta_contains;
+  };
+
+  // Takes the trees and the keys in merge, and searches the buffer for `key`
+  // while holding the lock, since it is modified in place.
+  View GetView(KeyType key) const {
+    std::shared_lock<std::shared_mutex> lock(mutex_);
+    const auto it = std::lower_bound(delta_.begin(), delta_.end(), key);
+    return View{base_, frozen_, static_cast<size_t>(it - delta_.begin()),
+                it != delta_.end() && *it == key};
+  }
+
+  size_t BaseRank(const Base& base, KeyType key) const {
+    if (base.keys.empty()) return 0;
+    return base.cht.LowerBound(base.keys.data(), key);
+  }
+
+  std::shared_ptr<const Base> Build(std::vector<KeyType> keys) const {
+    auto min = std::numeric_limits<KeyType>::min();
+    auto max = std::numeric_limits<KeyType>::max();
+    if (!keys.empty()) {
+      min = keys.front();
+      max = keys.back();
+    }
+    Builder<KeyType> chtb(min, max, num_bins_, max_error_);
+    for (const auto& key : keys) chtb.AddKey(key);
+    auto cht = chtb.Finalize();
+    return std::make_shared<const Base>(Base{std::move(keys), std::move(cht)});
+  }
+
+  // Runs on `merger_`: freezes the buffer once it is full, merges it into a
+  // new tree without holding the lock, and swaps the new tree in.
+  void MergeLoop() {
+    std::unique_lock<std::shared_mutex> lock(mutex_);
+    while (true) {
+      merge_cv_.wait(lock, [this] {
+        return stop_ || delta_.size() >= merge_threshold_ ||
+               (num_flushing_ && !delta_.empty());
+      });
+      if (stop_) break;
+
+      frozen_ = std::make_shared<const std::vector<KeyType>>(
+          std::move(delta_));
+      delta_.clear();
+      const auto base = base_;
+      const auto frozen = frozen_;
+      lock.unlock();
+
+      std::vector<KeyType> keys;
+      keys.reserve(base->keys.size() + frozen->size());
+      std::merge(base->keys.begin(), base->keys.end(), frozen->begin(),
+                 frozen->end(), std::back_inserter(keys));
+      auto merged = Build(std::move(keys));
+
+      lock.lock();
+      base_ = std::move(merged);
+      frozen_ = std::make_shared<const std::vector<KeyType>>();
+      if (delta_.empty()) flushed_cv_.notify_all();
+    }
+    flushed_cv_.notify_all();
+  }
+
+  const size_t num_bins_;
+  const size_t max_error_;
+  const size_t merge_threshold_;
+
+  // Guards the members below. The lookups take it shared.
+  mutable std::shared_mutex mutex_;
+  std::condition_variable_any merge_cv_;
+  std::condition_variable_any flushed_cv_;
+  bool stop_ = false;
+  // Number of threads waiting in `Flush`, which merge any non-empty buffer.
+  size_t num_flushing_ = 0;
+  // The indexed keys, which are immutable and replaced as a whole.
+  std::shared_ptr<const Base> base_;
+  // The keys being merged into the next `base_`.
+  std::shared_ptr<const std::vector<KeyType>> frozen_;
+  // The keys inserted since, sorted.
+  std::vector<KeyType> delta_;
+
+  std::thread merger_;
+};
+
+}  // namespace cht
@@ -1,16 +1,29 @@
 #include "include/cht/cht.h"
 
+#include <fstream>
 #include <random>
+#include <tuple>
 #include <unordered_set>
 
 #include "gtest/gtest.h"
+#include "include/cht/appendable.h"
 #include "include/cht/builder.h"
+#include "include/cht/sharded.h"
+#include "include/cht/simd.h"
+#include "include/cht/sosd.h"
+#include "include/cht/static_cht.h"
+#include "include/cht/tuner.h"
+#include "include/cht/updatable.h"
 
 const size_t kNumKeys = 1000;
 // Number of iterations (seeds) of random positive and negative test cases.
 const size_t kNumIterations = 10;
 const size_t kNumBins = 32;
 const size_t kMaxError = 32;
+// The kernels are tested with each instruction set up to the supported one.
+const cht::simd::Isa kAllIsas[] = {cht::simd::Isa::Scalar,
+                                   cht::simd::Isa::AVX2,
+                                   cht::simd::Isa::AVX512};
 
 namespace {
 
@@ -50,6 +63,12 @@ cht::CompactHistTree<KeyType> CreateCompactHistTree(const std::vector<KeyType>&
   return chtb.Finalize();
 }
 
+std::string ReadFile(const std::string& path) {
+  std::ifstream in(path, std::ios::binary);
+  return std::string(std::istreambuf_iterator<char>(in),
+                     std::istreambuf_iterator<char>());
+}
+
 template <class KeyType>
 bool BoundContains(const std::vector<KeyType>& keys, cht::SearchBound bound,
                    KeyType key) {
@@ -104,4 +123,1081 @@ TYPED_TEST(CompactHistTreeTest, AddAndLookupRandomIntegechtNegativeLookups) {
   }
 }
 
+TYPED_TEST(CompactHistTreeTest, BatchedLookupsMatchScalarLookups) {
+  using KeyType = typename TestFixture::KeyType;
+  for (const auto isa : kAllIsas) {
+    SCOPED_TRACE(static_cast<int>(isa));
+    cht::simd::SetMaxIsaForTesting(isa);
+    for (size_t i = 0; i < kNumIterations; ++i) {
+      const auto keys = CreateUniqueRandomKeys<KeyType>(/*seed=*/i);
+      auto lookup_keys = CreateUniqueRandomKeys<KeyType>(/*seed=*/815 + i);
+      lookup_keys.insert(lookup_keys.end(), keys.begin(), keys.end());
+      const auto cht = CreateCompactHistTree(keys);
+      std::vector<cht::SearchBound> bounds(lookup_keys.size());
+      cht.GetSearchBounds(lookup_keys.data(), lookup_keys.size(),
+                          bounds.data());
+      for (size_t j = 0; j < lookup_keys.size(); ++j) {
+        const auto bound = cht.GetSearchBound(lookup_keys[j]);
+        EXPECT_EQ(bound.begin, bounds[j].begin) << "key: " << lookup_keys[j];
+        EXPECT_EQ(bound.end, bounds[j].end) << "key: " << lookup_keys[j];
+      }
+    }
+  }
+  cht::simd::SetMaxIsaForTesting(cht::simd::Isa::AVX512);
+}
+
+TYPED_TEST(CompactHistTreeTest, LowerBoundMatchesStdLowerBound) {
+  using KeyType = typename TestFixture::KeyType;
+  using Row = std::pair<KeyType, size_t>;
+  for (const auto isa : kAllIsas) {
+    SCOPED_TRACE(static_cast<int>(isa));
+    cht::simd::SetMaxIsaForTesting(isa);
+    for (size_t i = 0; i < kNumIterations; ++i) {
+      const auto keys = CreateUniqueRandomKeys<KeyType>(/*seed=*/i);
+      auto lookup_keys = CreateUniqueRandomKeys<KeyType>(/*seed=*/815 + i);
+      lookup_keys.insert(lookup_keys.end(), keys.begin(), keys.end());
+      std::vector<Row> rows;
+      for (const auto& key : keys) rows.emplace_back(key, rows.size());
+      // Small windows are scanned, large ones are binary searched.
+      for (const size_t max_error : {size_t(4), size_t(256)}) {
+        cht::Builder<KeyType> chtb(keys.front(), keys.back(), kNumBins,
+                                   max_error);
+        for (const auto& key : keys) chtb.AddKey(key);
+        const auto cht = chtb.Finalize();
+        std::vector<size_t> positions(lookup_keys.size());
+        std::vector<size_t> row_positions(lookup_keys.size());
+        cht.LowerBounds(keys.data(), lookup_keys.data(), lookup_keys.size(),
+                        positions.data());
+        cht.LowerBounds(rows.data(), &Row::first, lookup_keys.data(),
+                        lookup_keys.size(), row_positions.data());
+        for (size_t j = 0; j < lookup_keys.size(); ++j) {
+          const auto key = lookup_keys[j];
+          const size_t expected =
+              std::lower_bound(keys.begin(), keys.end(), key) - keys.begin();
+          EXPECT_EQ(expected, cht.LowerBound(keys.data(), key))
+              << "key: " << key;
+          EXPECT_EQ(expected, cht.LowerBound(rows.data(), &Row::first, key))
+              << "key: " << key;
+          EXPECT_EQ(expected, positions[j]) << "key: " << key;
+          EXPECT_EQ(expected, row_positions[j]) << "key: " << key;
+        }
+      }
+    }
+  }
+  cht::simd::SetMaxIsaForTesting(cht::simd::Isa::AVX512);
+}
+
+TYPED_TEST(CompactHistTreeTest, LowerBoundOfDuplicatedMaxKey) {
+  using KeyType = typename TestFixture::KeyType;
+  const auto lookup_keys = CreateUniqueRandomKeys<KeyType>(/*seed=*/815);
+  // A few copies of the largest key, and more than `kMaxError`.
+  for (const size_t copies : {size_t(3), 3 * kMaxError}) {
+    auto keys = CreateUniqueRandomKeys<KeyType>(/*seed=*/42);
+    keys.insert(keys.end(), copies - 1, keys.back());
+    std::vector<KeyType> queries = keys;
+    queries.insert(queries.end(), lookup_keys.begin(), lookup_keys.end());
+
+    // (layout, tight)
+    const std::tuple<cht::Layout, bool> configs[] = {
+        {cht::Layout::Uniform, false},   {cht::Layout::Uniform, true},
+        {cht::Layout::Adaptive, false},  {cht::Layout::Adaptive, true},
+        {cht::Layout::Compressed, false}, {cht::Layout::Compressed, true}};
+    for (const auto& [layout, tight] : configs) {
+      cht::Builder<KeyType> chtb(keys.front(), keys.back(), kNumBins,
+                                 kMaxError);
+      if (layout == cht::Layout::Adaptive) chtb.UseAdaptiveFanout(1024);
+      if (layout == cht::Layout::Compressed) chtb.UsePathCompression();
+      if (tight) chtb.UseTightBounds();
+      const auto cht = chtb.Build(keys.data(), keys.size());
+      for (const auto isa : kAllIsas) {
+        SCOPED_TRACE(static_cast<int>(isa));
+        cht::simd::SetMaxIsaForTesting(isa);
+        std::vector<size_t> positions(queries.size());
+        cht.LowerBounds(keys.data(), queries.data(), queries.size(),
+                        positions.data());
+        for (size_t i = 0; i < queries.size(); ++i) {
+          const size_t expected =
+              std::lower_bound(keys.begin(), keys.end(), queries[i]) -
+              keys.begin();
+          EXPECT_EQ(expected, cht.LowerBound(keys.data(), queries[i]))
+              << "key: " << queries[i];
+          EXPECT_EQ(expected, positions[i]) << "key: " << queries[i];
+        }
+      }
+      cht::simd::SetMaxIsaForTesting(cht::simd::Isa::AVX512);
+
+      cht::WithStaticFanout(cht, [&](const auto& scht) {
+        const auto bound = scht.GetSearchBound(keys.back());
+        EXPECT_TRUE(BoundContains(keys, bound, keys.back()));
+        EXPECT_LE(bound.begin, keys.size() - copies);
+      });
+    }
+  }
+}
+
+TYPED_TEST(CompactHistTreeTest, SerializeAndMap) {
+  using KeyType = typename TestFixture::KeyType;
+  const auto keys = CreateUniqueRandomKeys<KeyType>(/*seed=*/42);
+  const auto lookup_keys = CreateUniqueRandomKeys<KeyType>(/*seed=*/815);
+  const auto cht = CreateCompactHistTree(keys);
+  const std::string path = testing::TempDir() + "cht_test.bin";
+  cht.Serialize(path);
+  const auto mapped = cht::CompactHistTree<KeyType>::Map(path);
+  std::remove(path.c_str());
+
+  EXPECT_EQ(cht.GetSize(), mapped.GetSize());
+  for (const auto& key : keys) {
+    EXPECT_TRUE(BoundContains(keys, mapped.GetSearchBound(key), key))
+        << "key: " << key;
+  }
+  for (const auto& key : lookup_keys) {
+    const auto expected = cht.GetSearchBound(key);
+    const auto actual = mapped.GetSearchBound(key);
+    EXPECT_EQ(expected.begin, actual.begin) << "key: " << key;
+    EXPECT_EQ(expected.end, actual.end) << "key: " << key;
+  }
+}
+
+TYPED_TEST(CompactHistTreeTest, MapRejectsOtherKeyType) {
+  using KeyType = typename TestFixture::KeyType;
+  using OtherKeyType =
+      std::conditional_t<std::is_same_v<KeyType, uint32_t>, uint64_t, uint32_t>;
+  const auto cht = CreateCompactHistTree(CreateDenseKeys<KeyType>());
+  const std::string path = testing::TempDir() + "cht_test_other.bin";
+  cht.Serialize(path);
+  EXPECT_THROW(cht::CompactHistTree<OtherKeyType>::Map(path),
+               std::runtime_error);
+  std::remove(path.c_str());
+}
+
+TYPED_TEST(CompactHistTreeTest, ParallelBuildIsIdenticalToSerialBuild) {
+  using KeyType = typename TestFixture::KeyType;
+  for (size_t i = 0; i < kNumIterations; ++i) {
+    const auto keys = CreateUniqueRandomKeys<KeyType>(/*seed=*/i);
+    for (const bool use_cache : {false, true}) {
+      std::string serialized[2];
+      for (const size_t num_threads : {1, 4}) {
+        cht::Builder<KeyType> chtb(keys.front(), keys.back(), /*num_bins=*/4,
+                                   /*max_error=*/2, /*single_pass=*/false,
+                                   use_cache, num_threads);
+        for (const auto& key : keys) chtb.AddKey(key);
+        const auto path = testing::TempDir() + "cht_test_parallel.bin";
+        chtb.Finalize().Serialize(path);
+        serialized[num_threads > 1] = ReadFile(path);
+        std::remove(path.c_str());
+      }
+      EXPECT_EQ(serialized[0], serialized[1]);
+    }
+  }
+}
+
+TYPED_TEST(CompactHistTreeTest, StaticFanoutMatchesDynamicFanout) {
+  using KeyType = typename TestFixture::KeyType;
+  for (size_t i = 0; i < kNumIterations; ++i) {
+    const auto keys = CreateUniqueRandomKeys<KeyType>(/*seed=*/i);
+    const auto lookup_keys = CreateUniqueRandomKeys<KeyType>(/*seed=*/815 + i);
+    const auto cht = CreateCompactHistTree(keys);
+    const bool dispatched = cht::WithStaticFanout(cht, [&](const auto& scht) {
+      for (const auto& key : keys) {
+        EXPECT_TRUE(BoundContains(keys, scht.GetSearchBound(key), key))
+            << "key: " << key;
+      }
+      for (const auto& key : lookup_keys) {
+        const auto expected = cht.GetSearchBound(key);
+        const auto actual = scht.GetSearchBound(key);
+        EXPECT_EQ(expected.begin, actual.begin) << "key: " << key;
+        EXPECT_EQ(expected.end, actual.end) << "key: " << key;
+      }
+    });
+    EXPECT_TRUE(dispatched);
+  }
+}
+
+TYPED_TEST(CompactHistTreeTest, WideEntriesMatchNarrowEntries) {
+  using KeyType = typename TestFixture::KeyType;
+  const auto keys = CreateUniqueRandomKeys<KeyType>(/*seed=*/42);
+  auto lookup_keys = CreateUniqueRandomKeys<KeyType>(/*seed=*/815);
+  lookup_keys.insert(lookup_keys.end(), keys.begin(), keys.end());
+  for (const bool single_pass : {false, true}) {
+    for (const bool use_cache : {false, true}) {
+      cht::Builder<KeyType> narrowb(keys.front(), keys.back(), kNumBins,
+                                    kMaxError, single_pass, use_cache);
+      cht::Builder<KeyType> wideb(keys.front(), keys.back(), kNumBins,
+                                  kMaxError, single_pass, use_cache);
+      wideb.ForceWideEntries();
+      for (const auto& key : keys) narrowb.AddKey(key), wideb.AddKey(key);
+      const auto narrow = narrowb.Finalize();
+      const auto wide = wideb.Finalize();
+      EXPECT_FALSE(narrow.HasWideEntries());
+      ASSERT_TRUE(wide.HasWideEntries());
+
+      // Also check the wide tree after a round trip through a file.
+      const std::string path = testing::TempDir() + "cht_test_wide.bin";
+      wide.Serialize(path);
+      const auto mapped = cht::CompactHistTree<KeyType>::Map(path);
+      std::remove(path.c_str());
+      EXPECT_TRUE(mapped.HasWideEntries());
+
+      std::vector<cht::SearchBound> bounds(lookup_keys.size());
+      wide.GetSearchBounds(lookup_keys.data(), lookup_keys.size(),
+                           bounds.data());
+      for (size_t i = 0; i < lookup_keys.size(); ++i) {
+        const auto expected = narrow.GetSearchBound(lookup_keys[i]);
+        for (const auto& actual : {wide.GetSearchBound(lookup_keys[i]),
+                                   mapped.GetSearchBound(lookup_keys[i]),
+                                   bounds[i]}) {
+          EXPECT_EQ(expected.begin, actual.begin) << "key: " << lookup_keys[i];
+          EXPECT_EQ(expected.end, actual.end) << "key: " << lookup_keys[i];
+        }
+      }
+    }
+  }
+}
+
+TYPED_TEST(CompactHistTreeTest, ReportsPeakBuildBytes) {
+  using KeyType = typename TestFixture::KeyType;
+  const auto keys = CreateUniqueRandomKeys<KeyType>(/*seed=*/42);
+  for (const bool single_pass : {false, true}) {
+    cht::Builder<KeyType> chtb(keys.front(), keys.back(), kNumBins, kMaxError,
+                               single_pass);
+    for (const auto& key : keys) chtb.AddKey(key);
+    const auto cht = chtb.Finalize();
+    // The offline build holds all keys, and both builds hold the table.
+    EXPECT_GE(chtb.GetPeakBytes(), cht.GetSize() - sizeof(cht));
+    if (!single_pass) {
+      EXPECT_GE(chtb.GetPeakBytes(), keys.size() * sizeof(KeyType));
+    }
+  }
+}
+
+TYPED_TEST(CompactHistTreeTest, SinglePassBuildIsIdenticalToOfflineBuild) {
+  using KeyType = typename TestFixture::KeyType;
+  for (size_t i = 0; i < kNumIterations; ++i) {
+    const auto keys = CreateUniqueRandomKeys<KeyType>(/*seed=*/i);
+    for (const bool use_cache : {false, true}) {
+      std::string serialized[2];
+      for (const bool single_pass : {false, true}) {
+        cht::Builder<KeyType> chtb(keys.front(), keys.back(), /*num_bins=*/4,
+                                   /*max_error=*/2, single_pass, use_cache);
+        for (const auto& key : keys) chtb.AddKey(key);
+        const auto path = testing::TempDir() + "cht_test_single_pass.bin";
+        chtb.Finalize().Serialize(path);
+        serialized[single_pass] = ReadFile(path);
+        std::remove(path.c_str());
+      }
+      EXPECT_EQ(serialized[0], serialized[1]);
+    }
+  }
+}
+
+TYPED_TEST(CompactHistTreeTest, BuildInPlaceIsIdenticalToAddKey) {
+  using KeyType = typename TestFixture::KeyType;
+  const auto keys = CreateUniqueRandomKeys<KeyType>(/*seed=*/42);
+  std::vector<std::pair<KeyType, uint64_t>> rows;
+  for (size_t i = 0; i < keys.size(); ++i) rows.push_back({keys[i], i});
+
+  // (single_pass, use_cache, max_adaptive_bins)
+  const std::tuple<bool, bool, size_t> configs[] = {
+      {false, false, 0}, {false, true, 0}, {true, false, 0},
+      {true, true, 0},   {false, false, 64}};
+  for (const auto& [single_pass, use_cache, max_adaptive_bins] : configs) {
+    const auto build = [&, single_pass = single_pass, use_cache = use_cache,
+                        max_adaptive_bins = max_adaptive_bins](int how) {
+      cht::Builder<KeyType> chtb(keys.front(), keys.back(), /*num_bins=*/4,
+                                 /*max_error=*/2, single_pass, use_cache);
+      if (max_adaptive_bins) chtb.UseAdaptiveFanout(max_adaptive_bins);
+      cht::CompactHistTree<KeyType> cht;
+      if (how == 0) {
+        for (const auto& key : keys) chtb.AddKey(key);
+        cht = chtb.Finalize();
+      } else if (how == 1) {
+        cht = chtb.Build(keys.data(), keys.size());
+      } else {
+        cht = chtb.Build(rows.data(), rows.size(),
+                         &std::pair<KeyType, uint64_t>::first);
+      }
+      const auto path = testing::TempDir() + "cht_test_in_place.bin";
+      cht.Serialize(path);
+      const auto serialized = ReadFile(path);
+      std::remove(path.c_str());
+      return std::make_pair(serialized, chtb.GetPeakBytes());
+    };
+    const auto expected = build(0);
+    for (const int how : {1, 2}) {
+      const auto [serialized, peak_bytes] = build(how);
+      EXPECT_EQ(serialized, expected.first);
+      // The offline build does not copy the keys.
+      if (!single_pass) {
+        EXPECT_LE(peak_bytes,
+                  expected.second - keys.size() * sizeof(KeyType));
+      }
+    }
+  }
+}
+
+TYPED_TEST(CompactHistTreeTest, BuildFromSosdFile) {
+  using KeyType = typename TestFixture::KeyType;
+  const auto keys = CreateUniqueRandomKeys<KeyType>(/*seed=*/42);
+  const auto path = testing::TempDir() + "cht_test_keys_sosd";
+  // Also every third key repeated, as in many SOSD datasets.
+  std::vector<KeyType> dupKeys;
+  for (size_t i = 0; i < keys.size(); ++i)
+    dupKeys.insert(dupKeys.end(), i % 3 ? 1 : 2, keys[i]);
+  const std::vector<KeyType> keySets[] = {keys, dupKeys};
+
+  for (const auto& fileKeys : keySets) {
+    {
+      std::ofstream out(path, std::ios::binary | std::ios::trunc);
+      const uint64_t size = fileKeys.size();
+      out.write(reinterpret_cast<const char*>(&size), sizeof(size));
+      out.write(reinterpret_cast<const char*>(fileKeys.data()),
+                fileKeys.size() * sizeof(KeyType));
+    }
+    const cht::SosdFile<KeyType> file(path);
+    ASSERT_EQ(file.size(), fileKeys.size());
+    EXPECT_TRUE(std::equal(fileKeys.begin(), fileKeys.end(), file.data()));
+    std::vector<KeyType> streamed;
+    file.ForEach([&](KeyType key) { streamed.push_back(key); });
+    EXPECT_EQ(streamed, fileKeys);
+
+    const auto lookup_keys = CreateUniqueRandomKeys<KeyType>(/*seed=*/815);
+    for (const bool use_cache : {false, true}) {
+      cht::Builder<KeyType> chtb(fileKeys.front(), fileKeys.back(), kNumBins,
+                                 kMaxError, /*single_pass=*/false, use_cache);
+      const auto offline = chtb.Build(fileKeys.data(), fileKeys.size());
+      const auto cht = cht::BuildFromSosdFile<KeyType>(path, kNumBins,
+                                                       kMaxError, use_cache);
+      for (const auto& key : fileKeys) {
+        const auto bound = cht.GetSearchBound(key);
+        const auto expectedBound = offline.GetSearchBound(key);
+        EXPECT_EQ(bound.begin, expectedBound.begin) << "key: " << key;
+        EXPECT_EQ(bound.end, expectedBound.end) << "key: " << key;
+      }
+      for (const auto& key : lookup_keys) {
+        const size_t expected =
+            std::lower_bound(fileKeys.begin(), fileKeys.end(), key) -
+            fileKeys.begin();
+        EXPECT_EQ(expected, cht.LowerBound(fileKeys.data(), key))
+            << "key: " << key;
+      }
+    }
+  }
+
+  // A file with fewer keys than its header claims.
+  {
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    const uint64_t size = keys.size() + 1;
+    out.write(reinterpret_cast<const char*>(&size), sizeof(size));
+    out.write(reinterpret_cast<const char*>(keys.data()),
+              keys.size() * sizeof(KeyType));
+  }
+  EXPECT_THROW(cht::SosdFile<KeyType>{path}, std::runtime_error);
+  std::remove(path.c_str());
+  EXPECT_THROW(cht::SosdFile<KeyType>{path}, std::runtime_error);
+}
+
+TYPED_TEST(CompactHistTreeTest, ShardedHistTree) {
+  using KeyType = typename TestFixture::KeyType;
+  // Keys with runs of duplicates, which must not straddle the shards, and
+  // end the shards.
+  std::vector<KeyType> keys;
+  for (const auto& key : CreateUniqueRandomKeys<KeyType>(/*seed=*/42))
+    keys.insert(keys.end(), 1 + key % 3, key);
+  keys.insert(keys.end(), 2, keys.back());
+  auto lookup_keys = CreateUniqueRandomKeys<KeyType>(/*seed=*/815);
+  lookup_keys.insert(lookup_keys.end(), keys.begin(), keys.end());
+
+  for (const size_t num_shards : {1, 7, 64}) {
+    for (const size_t num_threads : {1, 4}) {
+      const cht::ShardedHistTree<KeyType> sht(keys.data(), keys.size(),
+                                              num_shards, kNumBins, kMaxError,
+                                              num_threads);
+      EXPECT_GE(sht.GetNumShards(), 1);
+      EXPECT_LE(sht.GetNumShards(), num_shards);
+      for (size_t shard = 1; shard < sht.GetNumShards(); ++shard) {
+        const size_t offset = sht.GetShardOffset(shard);
+        EXPECT_NE(keys[offset - 1], keys[offset]);
+      }
+      for (const auto& key : keys) {
+        EXPECT_TRUE(BoundContains(keys, sht.GetSearchBound(key), key))
+            << "key: " << key;
+      }
+      for (const auto& key : lookup_keys) {
+        const size_t expected =
+            std::lower_bound(keys.begin(), keys.end(), key) - keys.begin();
+        EXPECT_EQ(sht.LowerBound(keys.data(), key), expected)
+            << "key: " << key;
+      }
+    }
+  }
+
+  // Serialize, and map all shards back.
+  const cht::ShardedHistTree<KeyType> sht(keys.data(), keys.size(),
+                                          /*num_shards=*/7, kNumBins,
+                                          kMaxError);
+  const std::string path = testing::TempDir() + "cht_test_sharded.bin";
+  sht.Serialize(path);
+  auto mapped = cht::ShardedHistTree<KeyType>::Map(path);
+  ASSERT_EQ(mapped.GetNumShards(), sht.GetNumShards());
+  for (size_t shard = 0; shard != sht.GetNumShards(); ++shard)
+    std::remove(cht::ShardedHistTree<KeyType>::ShardPath(path, shard).c_str());
+  std::remove(path.c_str());
+  EXPECT_EQ(mapped.GetSize(), sht.GetSize());
+
+  // Rebuild a single shard.
+  const size_t offset = sht.GetShardOffset(1);
+  const size_t size = sht.GetShardSize(1);
+  cht::Builder<KeyType> chtb(keys[offset], keys[offset + size - 1], kNumBins,
+                             kMaxError);
+  mapped.SetShard(1, chtb.Build(keys.data() + offset, size));
+  for (const auto& key : lookup_keys) {
+    const auto expected = sht.GetSearchBound(key);
+    const auto actual = mapped.GetSearchBound(key);
+    EXPECT_EQ(expected.begin, actual.begin) << "key: " << key;
+    EXPECT_EQ(expected.end, actual.end) << "key: " << key;
+  }
+}
+
+TYPED_TEST(CompactHistTreeTest, UpdatableTreeIndexesInsertedKeys) {
+  using KeyType = typename TestFixture::KeyType;
+  const auto keys = CreateUniqueRandomKeys<KeyType>(/*seed=*/42);
+  const auto inserted = CreateUniqueRandomKeys<KeyType>(/*seed=*/815);
+  std::vector<KeyType> initial;
+  for (size_t i = 0; i < keys.size(); i += 2) initial.push_back(keys[i]);
+
+  cht::UpdatableCompactHistTree<KeyType> ucht(initial, kNumBins, kMaxError,
+                                              /*merge_threshold=*/64);
+  std::vector<KeyType> all = initial;
+  auto check = [&]() {
+    std::sort(all.begin(), all.end());
+    ASSERT_EQ(all.size(), ucht.size());
+    for (const auto& key : all) {
+      EXPECT_TRUE(ucht.Contains(key)) << "key: " << key;
+      EXPECT_EQ(size_t(std::lower_bound(all.begin(), all.end(), key) -
+                       all.begin()),
+                ucht.Rank(key))
+          << "key: " << key;
+    }
+  };
+  // Insert the other half, out of order and with duplicates, and check the
+  // keys while merges are running in the background.
+  for (size_t i = 1; i < keys.size(); i += 2) {
+    ucht.Insert(inserted[i]);
+    ucht.Insert(keys[i]);
+    ucht.Insert(keys[i - 1]);
+    all.push_back(inserted[i]);
+    all.push_back(keys[i]);
+    all.push_back(keys[i - 1]);
+    if (i % 128 == 1) check();
+  }
+  check();
+  ucht.Flush();
+  check();
+  for (const auto& key : inserted) {
+    EXPECT_EQ(std::binary_search(all.begin(), all.end(), key),
+              ucht.Contains(key))
+        << "key: " << key;
+  }
+
+  // More copies of the largest key, which then ends the tree.
+  const KeyType max = all.back();
+  for (size_t i = 0; i < 3; ++i) {
+    ucht.Insert(max);
+    all.push_back(max);
+  }
+  ucht.Flush();
+  check();
+}
+
+TYPED_TEST(CompactHistTreeTest, AppendableTreeGrowsWithTheKeys) {
+  using KeyType = typename TestFixture::KeyType;
+  for (size_t i = 0; i < kNumIterations; ++i) {
+    // Timestamp-like keys: increasing, with bursts of duplicates, and gaps
+    // which grow such that the root needs to grow several times.
+    std::mt19937 g(i);
+    std::vector<KeyType> keys;
+    KeyType key = 1000 + i, gap = 1;
+    while (keys.size() < kNumKeys) {
+      keys.push_back(key);
+      if (g() % 8) key += 1 + g() % gap;
+      if (keys.size() % 100 == 0) gap *= 2;
+    }
+
+    cht::AppendableCompactHistTree<KeyType> acht(/*min_key=*/1000, kNumBins,
+                                                 kMaxError);
+    for (size_t j = 0; j < keys.size(); ++j) {
+      acht.Append(keys[j]);
+      if (j % 50 != 49 && j + 1 != keys.size()) continue;
+      // Look up the keys so far, the gaps between them and beyond them.
+      const std::vector<KeyType> current(keys.begin(), keys.begin() + j + 1);
+      for (const auto& lookup :
+           {current.front() - 1, current.back() + 1, current.back()}) {
+        EXPECT_EQ(size_t(std::lower_bound(current.begin(), current.end(),
+                                          lookup) -
+                         current.begin()),
+                  acht.LowerBound(lookup))
+            << "key: " << lookup;
+      }
+      for (const auto& key : current) {
+        EXPECT_TRUE(BoundContains(current, acht.GetSearchBound(key), key))
+            << "key: " << key;
+        EXPECT_EQ(size_t(std::lower_bound(current.begin(), current.end(),
+                                          key + 1) -
+                         current.begin()),
+                  acht.LowerBound(key + 1))
+            << "key: " << key + 1;
+      }
+    }
+    EXPECT_GT(acht.GetDepth(), 2u);
+  }
+}
+
+TYPED_TEST(CompactHistTreeTest, AdaptiveFanout) {
+  using KeyType = typename TestFixture::KeyType;
+  for (size_t i = 0; i < kNumIterations; ++i) {
+    // Uniform keys, and skewed keys which are dense in a few narrow ranges.
+    std::vector<std::vector<KeyType>> key_sets = {
+        CreateUniqueRandomKeys<KeyType>(/*seed=*/i)};
+    std::mt19937 g(i);
+    std::vector<KeyType> skewed;
+    for (size_t j = 0; j < kNumKeys; ++j) {
+      const KeyType base = KeyType(g() % 4) << (8 * sizeof(KeyType) - 3);
+      skewed.push_back(base + (g() % (j % 2 ? 100000 : 1000)));
+    }
+    std::sort(skewed.begin(), skewed.end());
+    key_sets.push_back(skewed);
+    auto lookup_keys = CreateUniqueRandomKeys<KeyType>(/*seed=*/815 + i);
+
+    for (const auto& keys : key_sets) {
+      std::vector<KeyType> all_lookup_keys = lookup_keys;
+      all_lookup_keys.insert(all_lookup_keys.end(), keys.begin(), keys.end());
+      for (const bool force_wide : {false, true}) {
+        cht::Builder<KeyType> chtb(keys.front(), keys.back(), kNumBins,
+                                   kMaxError);
+        chtb.UseAdaptiveFanout(/*max_num_bins=*/1024);
+        if (force_wide) chtb.ForceWideEntries();
+        for (const auto& key : keys) chtb.AddKey(key);
+        const auto cht = chtb.Finalize();
+        ASSERT_EQ(cht::Layout::Adaptive, cht.GetLayout());
+        EXPECT_EQ(force_wide, cht.HasWideEntries());
+
+        const std::string path = testing::TempDir() + "cht_test_adaptive.bin";
+        cht.Serialize(path);
+        const auto mapped = cht::CompactHistTree<KeyType>::Map(path);
+        std::remove(path.c_str());
+        EXPECT_EQ(cht::Layout::Adaptive, mapped.GetLayout());
+
+        std::vector<cht::SearchBound> bounds(all_lookup_keys.size());
+        cht.GetSearchBounds(all_lookup_keys.data(), all_lookup_keys.size(),
+                            bounds.data());
+        for (size_t j = 0; j < all_lookup_keys.size(); ++j) {
+          const auto key = all_lookup_keys[j];
+          EXPECT_EQ(size_t(std::lower_bound(keys.begin(), keys.end(), key) -
+                           keys.begin()),
+                    cht.LowerBound(keys.data(), key))
+              << "key: " << key;
+          const auto expected = cht.GetSearchBound(key);
+          for (const auto& actual : {mapped.GetSearchBound(key), bounds[j]}) {
+            EXPECT_EQ(expected.begin, actual.begin) << "key: " << key;
+            EXPECT_EQ(expected.end, actual.end) << "key: " << key;
+          }
+        }
+      }
+    }
+  }
+}
+
+TYPED_TEST(CompactHistTreeTest, PathCompression) {
+  using KeyType = typename TestFixture::KeyType;
+  for (size_t i = 0; i < kNumIterations; ++i) {
+    // Narrow clusters far apart, whose nodes form long single-child chains.
+    std::mt19937 g(i);
+    std::vector<KeyType> keys;
+    for (size_t j = 0; j < kNumKeys; ++j) {
+      const KeyType base = KeyType(g() % 8) << (8 * sizeof(KeyType) - 4);
+      keys.push_back(base + (g() % (j % 2 ? 100000 : 1000)));
+    }
+    std::sort(keys.begin(), keys.end());
+
+    // Also look up keys right next to the clusters, which leave the chains.
+    auto lookup_keys = CreateUniqueRandomKeys<KeyType>(/*seed=*/815 + i);
+    for (size_t j = 0; j < keys.size(); j += 97) {
+      for (const KeyType delta : {1, 1000, 1 << 20}) {
+        lookup_keys.push_back(keys[j] - delta);
+        lookup_keys.push_back(keys[j] + delta);
+      }
+    }
+    lookup_keys.insert(lookup_keys.end(), keys.begin(), keys.end());
+
+    cht::Builder<KeyType> uniformb(keys.front(), keys.back(), kNumBins,
+                                   kMaxError);
+    for (const auto& key : keys) uniformb.AddKey(key);
+    const auto uniform = uniformb.Finalize();
+
+    for (const bool force_wide : {false, true}) {
+      cht::Builder<KeyType> chtb(keys.front(), keys.back(), kNumBins,
+                                 kMaxError);
+      chtb.UsePathCompression();
+      if (force_wide) chtb.ForceWideEntries();
+      for (const auto& key : keys) chtb.AddKey(key);
+      const auto cht = chtb.Finalize();
+      ASSERT_EQ(cht::Layout::Compressed, cht.GetLayout());
+      EXPECT_EQ(force_wide, cht.HasWideEntries());
+      if (!force_wide) {
+        EXPECT_LT(cht.GetSize(), uniform.GetSize());
+      }
+
+      const std::string path = testing::TempDir() + "cht_test_compressed.bin";
+      cht.Serialize(path);
+      const auto mapped = cht::CompactHistTree<KeyType>::Map(path);
+      std::remove(path.c_str());
+      EXPECT_EQ(cht::Layout::Compressed, mapped.GetLayout());
+
+      // The chains are skipped, but the bounds are those of the uniform tree.
+      std::vector<cht::SearchBound> bounds(lookup_keys.size());
+      cht.GetSearchBounds(lookup_keys.data(), lookup_keys.size(),
+                          bounds.data());
+      for (size_t j = 0; j < lookup_keys.size(); ++j) {
+        const auto key = lookup_keys[j];
+        EXPECT_EQ(size_t(std::lower_bound(keys.begin(), keys.end(), key) -
+                         keys.begin()),
+                  cht.LowerBound(keys.data(), key))
+            << "key: " << key;
+        const auto expected = uniform.GetSearchBound(key);
+        for (const auto& actual :
+             {cht.GetSearchBound(key), mapped.GetSearchBound(key), bounds[j]}) {
+          EXPECT_EQ(expected.begin, actual.begin) << "key: " << key;
+          EXPECT_EQ(expected.end, actual.end) << "key: " << key;
+        }
+      }
+    }
+  }
+}
+
+TYPED_TEST(CompactHistTreeTest, RootFanout) {
+  using KeyType = typename TestFixture::KeyType;
+  for (size_t i = 0; i < kNumIterations; ++i) {
+    const auto keys = CreateUniqueRandomKeys<KeyType>(/*seed=*/i);
+    auto lookup_keys = CreateUniqueRandomKeys<KeyType>(/*seed=*/815 + i);
+    lookup_keys.insert(lookup_keys.end(), keys.begin(), keys.end());
+
+    for (const bool path_compression : {false, true}) {
+      for (const size_t num_threads : {1, 4}) {
+        cht::Builder<KeyType> chtb(keys.front(), keys.back(), kNumBins,
+                                   kMaxError, /*single_pass=*/false,
+                                   /*use_cache=*/false, num_threads);
+        chtb.UseRootFanout(/*root_num_bins=*/4096);
+        if (path_compression) chtb.UsePathCompression();
+        for (const auto& key : keys) chtb.AddKey(key);
+        const auto cht = chtb.Finalize();
+        EXPECT_EQ(kNumBins, cht.GetNumBins());
+
+        const std::string path = testing::TempDir() + "cht_test_root.bin";
+        cht.Serialize(path);
+        const auto mapped = cht::CompactHistTree<KeyType>::Map(path);
+        std::remove(path.c_str());
+
+        std::vector<cht::SearchBound> bounds(lookup_keys.size());
+        cht.GetSearchBounds(lookup_keys.data(), lookup_keys.size(),
+                            bounds.data());
+        for (size_t j = 0; j < lookup_keys.size(); ++j) {
+          const auto key = lookup_keys[j];
+          EXPECT_EQ(size_t(std::lower_bound(keys.begin(), keys.end(), key) -
+                           keys.begin()),
+                    cht.LowerBound(keys.data(), key))
+              << "key: " << key;
+          const auto expected = cht.GetSearchBound(key);
+          for (const auto& actual : {mapped.GetSearchBound(key), bounds[j]}) {
+            EXPECT_EQ(expected.begin, actual.begin) << "key: " << key;
+            EXPECT_EQ(expected.end, actual.end) << "key: " << key;
+          }
+        }
+
+        for (const auto& key : keys) {
+          EXPECT_TRUE(BoundContains(keys, cht.GetSearchBound(key), key))
+              << "key: " << key;
+        }
+
+        if (path_compression) continue;
+        const bool dispatched = cht::WithStaticFanout(cht, [&](const auto& scht) {
+          for (const auto& key : lookup_keys) {
+            EXPECT_EQ(cht.GetSearchBound(key).begin,
+                      scht.GetSearchBound(key).begin)
+                << "key: " << key;
+          }
+        });
+        EXPECT_TRUE(dispatched);
+      }
+    }
+  }
+}
+
+TYPED_TEST(CompactHistTreeTest, HugePageTables) {
+  using KeyType = typename TestFixture::KeyType;
+  // Small tables are aligned to a cache line, large ones to a huge page.
+  for (const size_t size : {size_t(100), cht::kHugePageSize}) {
+    for (const bool huge_pages : {false, true}) {
+      cht::TableVector<unsigned> entries(
+          size, cht::TableAllocator<unsigned>(huge_pages));
+      const auto address = reinterpret_cast<uintptr_t>(entries.data());
+      EXPECT_EQ(0u, address % cht::kCacheLineSize);
+      if (huge_pages && size == cht::kHugePageSize) {
+        EXPECT_EQ(0u, address % cht::kHugePageSize);
+      }
+    }
+  }
+
+  // A tree with a table of 4MB.
+  std::vector<KeyType> keys(1 << 20);
+  for (size_t i = 0; i < keys.size(); ++i) keys[i] = 2 * i;
+  std::vector<cht::CompactHistTree<KeyType>> chts;
+  for (const bool huge_pages : {false, true}) {
+    cht::Builder<KeyType> chtb(keys.front(), keys.back(), /*num_bins=*/1024,
+                               /*max_error=*/1);
+    if (!huge_pages) chtb.DisableHugePages();
+    for (const auto& key : keys) chtb.AddKey(key);
+    chts.push_back(chtb.Finalize());
+    EXPECT_GE(chts.back().GetAllocatedSize(), chts.back().GetSize());
+  }
+  EXPECT_EQ(chts[0].GetSize(), chts[1].GetSize());
+  EXPECT_EQ(0u, (chts[1].GetAllocatedSize() - sizeof(chts[1])) %
+                    cht::kHugePageSize);
+  for (size_t i = 0; i < keys.size(); i += 7) {
+    const auto key = keys[i] + (i % 2);
+    EXPECT_EQ(chts[0].GetSearchBound(key).begin,
+              chts[1].GetSearchBound(key).begin)
+        << "key: " << key;
+    EXPECT_EQ(i + (i % 2), chts[1].LowerBound(keys.data(), key));
+  }
+}
+
+TYPED_TEST(CompactHistTreeTest, TuneEstimatesTheTrees) {
+  using KeyType = typename TestFixture::KeyType;
+  const auto keys = CreateUniqueRandomKeys<KeyType>(/*seed=*/42);
+  const auto queries = CreateUniqueRandomKeys<KeyType>(/*seed=*/815);
+  const cht::internal::BlockStatistics<KeyType> stats(keys);
+
+  // For unique keys, the estimated trees are the built ones.
+  for (unsigned log_num_bins = 1; log_num_bins <= 10; ++log_num_bins) {
+    for (unsigned log_max_error = 1; log_max_error <= 10; ++log_max_error) {
+      const auto estimate =
+          cht::internal::EstimateTree(stats, log_num_bins, log_max_error);
+      if (!estimate.valid) continue;
+      cht::Builder<KeyType> chtb(keys.front(), keys.back(),
+                                 size_t(1) << log_num_bins,
+                                 size_t(1) << log_max_error);
+      for (const auto& key : keys) chtb.AddKey(key);
+      const auto cht = chtb.Finalize();
+      EXPECT_EQ(sizeof(cht) + (estimate.num_nodes << log_num_bins) *
+                                  sizeof(unsigned),
+                cht.GetSize())
+          << "log_num_bins: " << log_num_bins
+          << ", log_max_error: " << log_max_error;
+    }
+  }
+
+  const size_t budget = 64 << 10;
+  const auto tuned = cht::Tune(keys, queries, budget);
+  EXPECT_LE(tuned.size, budget);
+  EXPECT_GT(tuned.lookup_ns, 0);
+  cht::Builder<KeyType> chtb(keys.front(), keys.back(), tuned.num_bins,
+                             tuned.max_error);
+  for (const auto& key : keys) chtb.AddKey(key);
+  EXPECT_EQ(tuned.size, chtb.Finalize().GetSize());
+
+  // Without queries, nothing is timed.
+  EXPECT_EQ(0, cht::Tune(keys, {}, budget).lookup_ns);
+  // No tree fits into a single byte, so the smallest one is chosen.
+  EXPECT_GT(cht::Tune(keys, queries, /*memory_budget=*/1).size, 1u);
+
+  // A single distinct key spans no range, so there are no candidates.
+  const std::vector<KeyType> same(1000, 42);
+  const auto single = cht::Tune(same, queries, budget);
+  EXPECT_EQ(2u, single.num_bins);
+  EXPECT_EQ(same.size(), single.max_error);
+  EXPECT_EQ(0, single.lookup_ns);
+}
+
+TYPED_TEST(CompactHistTreeTest, Stats) {
+  using KeyType = typename TestFixture::KeyType;
+  auto keys = CreateUniqueRandomKeys<KeyType>(/*seed=*/42);
+
+  // Half of the keys are duplicates of a single one.
+  auto duplicates = keys;
+  std::fill(duplicates.begin() + 250, duplicates.begin() + 750, keys[250]);
+
+  for (const auto* data : {&keys, &duplicates}) {
+    for (const auto layout : {cht::Layout::Uniform, cht::Layout::Adaptive,
+                              cht::Layout::Compressed}) {
+      cht::Builder<KeyType> chtb(data->front(), data->back(), kNumBins,
+                                 kMaxError);
+      if (layout == cht::Layout::Adaptive) chtb.UseAdaptiveFanout(1024);
+      if (layout == cht::Layout::Compressed) chtb.UsePathCompression();
+      for (const auto& key : *data) chtb.AddKey(key);
+      const auto cht = chtb.Finalize();
+      const auto stats = cht.Stats();
+
+      // The nodes make up the table.
+      ASSERT_EQ(stats.nodes_per_level.size(), stats.bytes_per_level.size());
+      EXPECT_EQ(1u, stats.nodes_per_level[0]);
+      size_t bytes = 0;
+      for (const auto level_bytes : stats.bytes_per_level) bytes += level_bytes;
+      EXPECT_EQ(cht.GetSize() - sizeof(cht), bytes);
+      EXPECT_EQ(stats.nodes_per_level.size(), stats.max_depth);
+      EXPECT_GE(stats.avg_depth, 1);
+      EXPECT_LE(stats.avg_depth, stats.max_depth);
+
+      // The leaves hold all keys, and only the duplicates exceed the error.
+      ASSERT_EQ(kMaxError + 2, stats.keys_per_leaf.size());
+      size_t num_leaves = 0, num_keys = 0;
+      for (size_t i = 0; i <= kMaxError; ++i) {
+        num_leaves += stats.keys_per_leaf[i];
+        num_keys += i * stats.keys_per_leaf[i];
+      }
+      num_leaves += stats.keys_per_leaf.back();
+      EXPECT_EQ(stats.num_leaves, num_leaves);
+      EXPECT_EQ(stats.num_oversized_leaves, stats.keys_per_leaf.back());
+      if (data == &keys) {
+        EXPECT_EQ(0u, stats.num_oversized_leaves);
+        EXPECT_EQ(keys.size(), num_keys);
+      } else {
+        EXPECT_EQ(1u, stats.num_oversized_leaves);
+        EXPECT_EQ(duplicates.size() - 500, num_keys);
+      }
+    }
+  }
+}
+
+TYPED_TEST(CompactHistTreeTest, LookupCounters) {
+  using KeyType = typename TestFixture::KeyType;
+  const auto keys = CreateUniqueRandomKeys<KeyType>(/*seed=*/42);
+  const auto lookup_keys = CreateUniqueRandomKeys<KeyType>(/*seed=*/815);
+  for (const auto layout : {cht::Layout::Uniform, cht::Layout::Adaptive,
+                            cht::Layout::Compressed}) {
+    cht::Builder<KeyType> chtb(keys.front(), keys.back(), kNumBins, kMaxError);
+    if (layout == cht::Layout::Adaptive) chtb.UseAdaptiveFanout(1024);
+    if (layout == cht::Layout::Compressed) chtb.UsePathCompression();
+    for (const auto& key : keys) chtb.AddKey(key);
+    const auto cht = chtb.Finalize();
+
+    // The instrumented lookups return the same results.
+    cht::LookupCounters counters(/*sample_every=*/10);
+    for (const auto& key : lookup_keys) {
+      const auto expected = cht.GetSearchBound(key);
+      const auto actual = cht.GetSearchBound(key, counters);
+      EXPECT_EQ(expected.begin, actual.begin) << "key: " << key;
+      EXPECT_EQ(expected.end, actual.end) << "key: " << key;
+      EXPECT_EQ(cht.LowerBound(keys.data(), key),
+                cht.LowerBound(keys.data(), key, counters))
+          << "key: " << key;
+    }
+
+    const size_t num_lookups = 2 * lookup_keys.size();
+    EXPECT_EQ(num_lookups, counters.GetNumLookups());
+    EXPECT_EQ(num_lookups / 10, counters.GetNumSamples());
+    EXPECT_LE(counters.GetCyclesPercentile(50),
+              counters.GetCyclesPercentile(99));
+
+    // Each lookup accessed as many levels as it is counted for.
+    size_t num_accesses = 0, sum_levels = 0, num_by_levels = 0,
+           num_by_window = 0;
+    for (const auto count : counters.GetAccessesPerLevel())
+      num_accesses += count;
+    const auto& by_levels = counters.GetLookupsPerNumLevels();
+    for (size_t i = 0; i < by_levels.size(); ++i) {
+      sum_levels += i * by_levels[i];
+      num_by_levels += by_levels[i];
+    }
+    for (const auto count : counters.GetWindowsPerLogSize())
+      num_by_window += count;
+    EXPECT_EQ(num_accesses, sum_levels);
+    EXPECT_EQ(num_lookups, num_by_levels);
+    EXPECT_EQ(num_lookups, num_by_window);
+    EXPECT_LE(counters.GetAccessesPerLevel()[0], num_lookups);
+  }
+}
+
+TYPED_TEST(CompactHistTreeTest, TightBounds) {
+  using KeyType = typename TestFixture::KeyType;
+  // Keys with runs of duplicates, some of which exceed `max_error`.
+  std::vector<KeyType> keys;
+  for (const auto& key : CreateUniqueRandomKeys<KeyType>(/*seed=*/42))
+    keys.insert(keys.end(), key % 16 ? 1 : 3 * kMaxError, key);
+  const auto lookup_keys = CreateUniqueRandomKeys<KeyType>(/*seed=*/815);
+
+  // (use_cache, max_adaptive_bins, path_compression, root_num_bins, wide)
+  const std::tuple<bool, size_t, bool, size_t, bool> configs[] = {
+      {false, 0, false, 0, false},  {true, 0, false, 0, false},
+      {false, 64, false, 0, false}, {false, 0, true, 0, false},
+      {false, 0, false, 256, false}, {false, 0, false, 0, true}};
+  for (const auto& [use_cache, max_adaptive_bins, path_compression,
+                    root_num_bins, wide] : configs) {
+    cht::CompactHistTree<KeyType> chts[2];
+    for (const bool tight : {false, true}) {
+      cht::Builder<KeyType> chtb(keys.front(), keys.back(), kNumBins,
+                                 kMaxError, /*single_pass=*/false, use_cache);
+      if (max_adaptive_bins) chtb.UseAdaptiveFanout(max_adaptive_bins);
+      if (path_compression) chtb.UsePathCompression();
+      if (root_num_bins) chtb.UseRootFanout(root_num_bins);
+      if (wide) chtb.ForceWideEntries();
+      if (tight) chtb.UseTightBounds();
+      chts[tight] = chtb.Build(keys.data(), keys.size());
+    }
+    const auto& loose = chts[0];
+    const auto& cht = chts[1];
+    EXPECT_FALSE(loose.HasTightBounds());
+    EXPECT_TRUE(cht.HasTightBounds());
+
+    // The bounds are within the regular ones, and shrink on average.
+    size_t looseSize = 0, tightSize = 0;
+    for (const auto& key : keys) {
+      const auto bound = cht.GetSearchBound(key);
+      const auto expected = loose.GetSearchBound(key);
+      EXPECT_TRUE(BoundContains(keys, bound, key)) << "key: " << key;
+      EXPECT_EQ(bound.begin, expected.begin) << "key: " << key;
+      EXPECT_LE(bound.end, expected.end) << "key: " << key;
+      looseSize += expected.end - expected.begin;
+      tightSize += bound.end - bound.begin;
+    }
+    EXPECT_LT(tightSize, looseSize);
+    std::vector<KeyType> queries = keys;
+    queries.insert(queries.end(), lookup_keys.begin(), lookup_keys.end());
+    std::vector<cht::SearchBound> bounds(queries.size());
+    cht.GetSearchBounds(queries.data(), queries.size(), bounds.data());
+    for (size_t i = 0; i < queries.size(); ++i) {
+      const auto bound = cht.GetSearchBound(queries[i]);
+      EXPECT_EQ(bounds[i].begin, bound.begin) << "key: " << queries[i];
+      EXPECT_EQ(bounds[i].end, bound.end) << "key: " << queries[i];
+      const size_t expected =
+          std::lower_bound(keys.begin(), keys.end(), queries[i]) -
+          keys.begin();
+      EXPECT_EQ(cht.LowerBound(keys.data(), queries[i]), expected)
+          << "key: " << queries[i];
+    }
+
+    cht::WithStaticFanout(cht, [&](const auto& scht) {
+      for (const auto& key : queries) {
+        const auto expected = cht.GetSearchBound(key);
+        const auto actual = scht.GetSearchBound(key);
+        EXPECT_EQ(expected.begin, actual.begin) << "key: " << key;
+        EXPECT_EQ(expected.end, actual.end) << "key: " << key;
+      }
+    });
+
+    const std::string path = testing::TempDir() + "cht_test_tight.bin";
+    cht.Serialize(path);
+    EXPECT_TRUE(cht::CompactHistTree<KeyType>::Map(path).HasTightBounds());
+    std::remove(path.c_str());
+  }
+}
+
+
+TYPED_TEST(CompactHistTreeTest, Interpolation) {
+  using KeyType = typename TestFixture::KeyType;
+  const size_t max_error = 256;
+  // Short runs of duplicates, and runs longer than `max_error`, which are in
+  // oversized bins.
+  std::vector<KeyType> dupKeys, longRunKeys;
+  for (const auto& key : CreateUniqueRandomKeys<KeyType>(/*seed=*/42)) {
+    dupKeys.insert(dupKeys.end(), key % 16 ? 1 : 1 + key % 64, key);
+    longRunKeys.insert(longRunKeys.end(), key % 64 ? 1 : 2 * max_error, key);
+  }
+  const std::vector<KeyType> keySets[] = {
+      CreateDenseKeys<KeyType>(), CreateUniqueRandomKeys<KeyType>(/*seed=*/7),
+      dupKeys, longRunKeys};
+  const auto lookup_keys = CreateUniqueRandomKeys<KeyType>(/*seed=*/815);
+
+  // (num_bins, use_cache, root_num_bins, wide)
+  const std::tuple<size_t, bool, size_t, bool> configs[] = {
+      {kNumBins, false, 0, false}, {4, false, 0, false},
+      {4, true, 0, false},         {4, false, 64, false},
+      {4, false, 0, true}};
+  for (const auto& keys : keySets) {
+    const bool unique = &keys < keySets + 2;
+    std::vector<KeyType> queries = keys;
+    queries.insert(queries.end(), lookup_keys.begin(), lookup_keys.end());
+    for (const auto& [num_bins, use_cache, root_num_bins, wide] : configs) {
+      cht::CompactHistTree<KeyType> chts[2];
+      for (const bool interpolation : {false, true}) {
+        cht::Builder<KeyType> chtb(keys.front(), keys.back(), num_bins,
+                                   max_error, /*single_pass=*/false,
+                                   use_cache);
+        if (root_num_bins) chtb.UseRootFanout(root_num_bins);
+        if (wide) chtb.ForceWideEntries();
+        chtb.UseTightBounds();
+        if (interpolation) chtb.UseInterpolation();
+        chts[interpolation] = chtb.Build(keys.data(), keys.size());
+      }
+      const auto& tight = chts[0];
+      const auto& cht = chts[1];
+      EXPECT_FALSE(tight.IsInterpolated());
+      EXPECT_TRUE(cht.IsInterpolated());
+      EXPECT_GT(cht.GetSize(), tight.GetSize());
+
+      // The bounds are within the tight ones, and cover the lower bounds.
+      size_t tightSize = 0, size = 0;
+      for (const auto& key : keys) {
+        const auto bound = cht.GetSearchBound(key);
+        const auto expected = tight.GetSearchBound(key);
+        EXPECT_TRUE(BoundContains(keys, bound, key)) << "key: " << key;
+        EXPECT_GE(bound.begin, expected.begin) << "key: " << key;
+        EXPECT_LE(bound.end, expected.end) << "key: " << key;
+        tightSize += expected.end - expected.begin;
+        size += bound.end - bound.begin;
+      }
+      if (unique) {
+        EXPECT_LT(size, tightSize);
+        // With the smaller fanouts, the last bin of each node keeps the
+        // tight bound.
+        if (num_bins == kNumBins) {
+          EXPECT_LT(2 * size, tightSize);
+        }
+      }
+      std::vector<cht::SearchBound> bounds(queries.size());
+      cht.GetSearchBounds(queries.data(), queries.size(), bounds.data());
+      for (size_t i = 0; i < queries.size(); ++i) {
+        const auto bound = cht.GetSearchBound(queries[i]);
+        EXPECT_EQ(bounds[i].begin, bound.begin) << "key: " << queries[i];
+        EXPECT_EQ(bounds[i].end, bound.end) << "key: " << queries[i];
+        const size_t expected =
+            std::lower_bound(keys.begin(), keys.end(), queries[i]) -
+            keys.begin();
+        EXPECT_EQ(cht.LowerBound(keys.data(), queries[i]), expected)
+            << "key: " << queries[i];
+      }
+
+      const std::string path = testing::TempDir() + "cht_test_interp.bin";
+      cht.Serialize(path);
+      const auto mapped = cht::CompactHistTree<KeyType>::Map(path);
+      std::remove(path.c_str());
+      EXPECT_TRUE(mapped.IsInterpolated());
+      EXPECT_EQ(mapped.GetSize(), cht.GetSize());
+      for (const auto& key : queries) {
+        const auto expected = cht.GetSearchBound(key);
+        const auto actual = mapped.GetSearchBound(key);
+        EXPECT_EQ(expected.begin, actual.begin) << "key: " << key;
+        EXPECT_EQ(expected.end, actual.end) << "key: " << key;
+      }
+    }
+  }
+
+  // The positions of dense keys are interpolated exactly, so the bounds of a
+  // tree with a large `max_error` are as narrow as the tight bounds of a much
+  // deeper tree.
+  const auto keys = CreateDenseKeys<KeyType>();
+  size_t sizes[2] = {0, 0};
+  for (const bool interpolation : {false, true}) {
+    cht::Builder<KeyType> chtb(keys.front(), keys.back(), kNumBins,
+                               interpolation ? max_error : 16);
+    chtb.UseTightBounds();
+    if (interpolation) chtb.UseInterpolation();
+    const auto cht = chtb.Build(keys.data(), keys.size());
+    for (const auto& key : keys) {
+      const auto bound = cht.GetSearchBound(key);
+      sizes[interpolation] += bound.end - bound.begin;
+    }
+  }
+  EXPECT_LE(sizes[1], sizes[0]);
+}
+
 }  // namespace